@@ -0,0 +1,129 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+#include "Filter.hpp"
+
+namespace {
+	constexpr uint32_t rateEstimationIntervals = 32;
+
+	/// RBJ cookbook low-pass with Butterworth Q
+	void DesignLowPass(FilterState& state, float cutoff, float rate) {
+		// Cutoff at or above Nyquist frequency makes no sense, so keep it just below
+		cutoff = std::min(cutoff, rate * 0.45f);
+		constexpr float q = std::numbers::sqrt2_v<float> / 2;
+		const float w0 = 2 * std::numbers::pi_v<float> * cutoff / rate;
+		const float alpha = std::sin(w0) / (2 * q);
+		const float cosw0 = std::cos(w0);
+		const float a0 = 1 + alpha;
+
+		state.b0 = (1 - cosw0) / 2 / a0;
+		state.b1 = (1 - cosw0) / a0;
+		state.b2 = state.b0;
+		state.a1 = -2 * cosw0 / a0;
+		state.a2 = (1 - alpha) / a0;
+		state.designed = true;
+	}
+
+	void LowPass(const FilterStage& stage, FilterState& state, std::array<float, 3>& v, float dt) {
+		if (!state.designed) {
+			if (stage.rate > 0) {
+				DesignLowPass(state, stage.cutoff, stage.rate);
+			} else {
+				// Pass values through until we know how often they come
+				if (dt > 0) {
+					state.intervalSum += dt;
+					if (++state.intervals == rateEstimationIntervals) {
+						DesignLowPass(state, stage.cutoff, rateEstimationIntervals / state.intervalSum);
+					}
+				}
+				state.x1 = state.x2 = state.y1 = state.y2 = v;
+				return;
+			}
+		}
+
+		for (size_t i = 0; i < 3; ++i) {
+			const float y = state.b0 * v[i] + state.b1 * state.x1[i] + state.b2 * state.x2[i] - state.a1 * state.y1[i] - state.a2 * state.y2[i];
+			state.x2[i] = state.x1[i];
+			state.x1[i] = v[i];
+			state.y2[i] = state.y1[i];
+			state.y1[i] = y;
+			v[i] = y;
+		}
+	}
+
+	float SmoothingFactor(float cutoff, float dt) {
+		const float tau = 1 / (2 * std::numbers::pi_v<float> * cutoff);
+		return 1 / (1 + tau / dt);
+	}
+
+	void OneEuro(const FilterStage& stage, FilterState& state, std::array<float, 3>& v, float dt) {
+		if (dt <= 0) {
+			// Can't do much without knowing time, and first sample has nothing to compare against anyways
+			state.y1 = v;
+			return;
+		}
+
+		const float alphaDerivative = SmoothingFactor(stage.derivativeCutoff, dt);
+		for (size_t i = 0; i < 3; ++i) {
+			const float derivative = (v[i] - state.y1[i]) / dt;
+			state.derivative[i] += alphaDerivative * (derivative - state.derivative[i]);
+			const float alpha = SmoothingFactor(stage.minCutoff + stage.beta * std::abs(state.derivative[i]), dt);
+			state.y1[i] += alpha * (v[i] - state.y1[i]);
+			v[i] = state.y1[i];
+		}
+	}
+
+	void Deadzone(const FilterStage& stage, std::array<float, 3>& v) {
+		for (size_t i = 0; i < 3; ++i) {
+			v[i] = (std::abs(v[i]) < stage.threshold ? 0.0f : v[i]);
+		}
+	}
+}
+
+void ApplyFilterChain(const FilterChain& chain, FilterStates& states, std::array<float, 3>& values, float dt) noexcept {
+	for (uint8_t i = 0; i < chain.count; ++i) {
+		auto& stage = chain.stages[i];
+		auto& state = states[i];
+		float stageDt = dt;
+
+		if (!state.primed) {
+			// Start from steady state at first value rather than from zero
+			state.primed = true;
+			state.x1 = state.x2 = state.y1 = state.y2 = values;
+			state.derivative = {};
+			stageDt = 0;
+		}
+
+		switch (stage.type) {
+		case FilterStage::Type::LowPass:
+			LowPass(stage, state, values, stageDt);
+			break;
+		case FilterStage::Type::OneEuro:
+			OneEuro(stage, state, values, stageDt);
+			break;
+		case FilterStage::Type::Deadzone:
+			Deadzone(stage, values);
+			break;
+		}
+	}
+}
@@ -0,0 +1,74 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+constexpr uint8_t MAX_FILTER_STAGES = 4; ///< Per sensor, so that state can live inside device
+
+/// One stage of filter chain, applied to all three axes of either accelerometer or gyro at once
+struct FilterStage {
+	enum class Type {
+		LowPass, ///< Second order Butterworth low-pass (biquad)
+		OneEuro, ///< One Euro filter: smooths slow motion while keeping fast one responsive
+		Deadzone ///< Zero out values close enough to zero
+	};
+
+	Type type;
+
+	// LowPass
+	float cutoff = 0; ///< Hz
+	float rate = 0; ///< Sample rate in Hz, estimated from timestamps if zero
+
+	// OneEuro
+	float minCutoff = 1.0f; ///< Hz
+	float beta = 0.0f;
+	float derivativeCutoff = 1.0f; ///< Hz
+
+	// Deadzone
+	float threshold = 0; ///< In units of output (G or degrees per second)
+};
+
+struct FilterChain {
+	std::array<FilterStage, MAX_FILTER_STAGES> stages;
+	uint8_t count = 0;
+};
+
+/// Per-device state of one stage
+struct FilterState {
+	bool primed = false; ///< Got first sample already
+
+	// LowPass: history and coefficients
+	std::array<float, 3> x1, x2, y1, y2;
+	float b0, b1, b2, a1, a2;
+	bool designed = false;
+	uint32_t intervals = 0; ///< For sample rate estimation
+	float intervalSum = 0;
+
+	// OneEuro: y1 holds previous output
+	std::array<float, 3> derivative;
+};
+
+using FilterStates = std::array<FilterState, MAX_FILTER_STAGES>;
+
+/// Run values through filter chain in place
+/// dt is time since previous sample in seconds, or zero if unknown
+void ApplyFilterChain(const FilterChain& chain, FilterStates& states, std::array<float, 3>& values, float dt) noexcept;
@@ -0,0 +1,129 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <numbers>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "SyntheticSource.hpp"
+
+SyntheticSource::SyntheticSource(const SyntheticConfiguration& conf_): conf(conf_) {
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		throw std::system_error(errno, std::generic_category(), "can't create timer for synthetic device");
+	}
+
+	const auto period = static_cast<long>(1e9 / conf.rate);
+	itimerspec spec {};
+	spec.it_interval.tv_sec = period / 1000000000;
+	spec.it_interval.tv_nsec = period % 1000000000;
+	spec.it_value = spec.it_interval;
+	if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+		close(fd);
+		throw std::system_error(errno, std::generic_category(), "can't start timer for synthetic device");
+	}
+
+	lastTimestamp = conf.timestampStart;
+}
+
+SyntheticSource::~SyntheticSource() {
+	close(fd);
+}
+
+libevdev* SyntheticSource::CreateDevice(const std::string& name) const {
+	libevdev* dev = libevdev_new();
+	libevdev_set_name(dev, name.c_str());
+	libevdev_enable_property(dev, INPUT_PROP_ACCELEROMETER);
+
+	for (int code = ABS_X; code <= ABS_RZ; ++code) {
+		input_absinfo info {};
+		info.minimum = -axisMax;
+		info.maximum = axisMax;
+		// Units per G for accelerometer and per degree/s for gyro, roughly matching hid-nintendo
+		info.resolution = (code < ABS_RX ? 4096 : 14);
+		libevdev_enable_event_code(dev, EV_ABS, code, &info);
+	}
+
+	if (conf.timestamps) {
+		libevdev_enable_event_code(dev, EV_MSC, MSC_TIMESTAMP, nullptr);
+	}
+
+	return dev;
+}
+
+uint64_t SyntheticSource::Expirations() noexcept {
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return 0;
+	}
+	return count;
+}
+
+void SyntheticSource::Skip() noexcept {
+	sampleIndex += Expirations();
+}
+
+void SyntheticSource::NextSample(std::array<int32_t, 6>& axes, int32_t& eventTimestamp, struct timeval& time) noexcept {
+	const double t = static_cast<double>(sampleIndex) / conf.rate;
+
+	for (size_t i = 0; i < axes.size(); ++i) {
+		// Shift phase for each axis so that they're distinguishable
+		double phase = conf.frequency * t + static_cast<double>(i) / axes.size();
+		phase -= std::floor(phase);
+
+		double value = 0;
+		switch (conf.waveform) {
+		case SyntheticConfiguration::Waveform::Sine:
+			value = std::sin(2 * std::numbers::pi * phase);
+			break;
+		case SyntheticConfiguration::Waveform::Square:
+			value = (phase < 0.5 ? 1.0 : -1.0);
+			break;
+		case SyntheticConfiguration::Waveform::Triangle:
+			value = 4 * std::abs(phase - 0.5) - 1;
+			break;
+		case SyntheticConfiguration::Waveform::Sawtooth:
+			value = 2 * phase - 1;
+			break;
+		}
+
+		axes[i] = static_cast<int32_t>(value * conf.amplitude * axisMax);
+	}
+
+	// Jitter only ever delays samples and never reorders them, just like with real hardware
+	uint64_t timestamp = conf.timestampStart + static_cast<uint64_t>(t * 1000000);
+	if (conf.jitter) {
+		timestamp += std::uniform_int_distribution<uint32_t>(0, conf.jitter)(rng);
+	}
+	timestamp = std::max(timestamp, lastTimestamp);
+	lastTimestamp = timestamp;
+
+	// Kernel timestamps wrap around at 31 bits as far as VirtualDevice is concerned
+	constexpr uint64_t signBit = 1ull << 31;
+	eventTimestamp = static_cast<int32_t>(timestamp % signBit);
+	time.tv_sec = timestamp / 1000000;
+	time.tv_usec = timestamp % 1000000;
+
+	++sampleIndex;
+}
@@ -0,0 +1,78 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <libevdev/libevdev.h>
+
+#include <array>
+#include <cstdint>
+#include <random>
+#include <string>
+
+/// Parameters of generated motion
+struct SyntheticConfiguration {
+	enum class Waveform {
+		Sine,
+		Square,
+		Triangle,
+		Sawtooth
+	};
+
+	Waveform waveform = Waveform::Sine;
+	double rate = 1000.0; ///< Samples per second
+	double frequency = 1.0; ///< Frequency of waveform itself, Hz
+	double amplitude = 0.5; ///< Fraction of axis range to use, 0-1
+	uint32_t jitter = 0; ///< Maximum random delay added to each timestamp, microseconds
+	uint32_t timestampStart = 0; ///< First MSC_TIMESTAMP value, set close to 2^31 to test wraparound handling
+	bool timestamps = true; ///< Whether to provide MSC_TIMESTAMP at all
+};
+
+/// Deterministic motion generator driven by timerfd, pretending to be an evdev device
+class SyntheticSource {
+	public:
+		/// Raw axis range exposed by fake device, matching what real drivers commonly do
+		static constexpr int32_t axisMax = 32767;
+
+		SyntheticSource() = delete;
+		SyntheticSource(const SyntheticConfiguration& conf_);
+		SyntheticSource(const SyntheticSource&) = delete;
+		SyntheticSource(SyntheticSource&&) = delete;
+		~SyntheticSource();
+
+		/// Create fd-less libevdev device describing generated axes
+		/// Note: it is up to caller to free it
+		libevdev* CreateDevice(const std::string& name) const;
+		int GetFd() const { return fd; };
+
+		/// Number of samples that should be generated by now
+		uint64_t Expirations() noexcept;
+		/// Drop samples that should be generated by now, so that next one is on time as if they were lost
+		void Skip() noexcept;
+
+		/// Generate next sample in raw device units
+		void NextSample(std::array<int32_t, 6>& axes, int32_t& eventTimestamp, struct timeval& time) noexcept;
+	private:
+		SyntheticConfiguration conf;
+		int fd;
+
+		uint64_t sampleIndex = 0;
+		uint64_t lastTimestamp = 0;
+		std::mt19937 rng {0}; // Fixed seed, so runs are reproducible
+};
@@ -16,6 +16,8 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
@@ -23,19 +25,44 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 
 #include "VirtualDevice.hpp"
 #include "globals.hpp"
+#include "realtime.hpp"
 
-VirtualDevice::VirtualDevice(uint8_t number_): number(number_) {};
+VirtualDevice::VirtualDevice(uint8_t number_): number(number_) {
+	// Glib timeouts only have millisecond precision, which is too coarse for batch deadlines
+	// If this fails, batches are still sent once next sample is past deadline
+	batchTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	updateInfo();
+};
 
 VirtualDevice::~VirtualDevice() {
 	Disconnect();
+	if (batchTimerSource) {
+		batchTimerSource->destroy();
+	}
+	if (batchTimer != -1) {
+		close(batchTimer);
+	}
 }
 
-bool VirtualDevice::Connect(libevdev* device) noexcept {
-	Disconnect(); // Just in case
+bool VirtualDevice::Connect(libevdev* device, const char* devnode_) noexcept {
+	const char* const newUniq = libevdev_get_uniq(device);
+	// Same name is guaranteed by caller, and devices lacking unique id have to make do with it
+	const bool sameDevice = reconnecting && uniq == (newUniq ? newUniq : "");
+
+	if (sameDevice) {
+		// Nothing to release after lost(), and going through Disconnect() would make slot flap to disconnected for clients
+		grace_timeout.disconnect();
+		reconnecting = false;
+	} else if (!synthetic) {
+		Disconnect(); // Just in case
+	}
 	dev = device;
+	devnode = (devnode_ ? devnode_ : "");
+	uniq = (newUniq ? newUniq : "");
 
 	// Make sure that we have at least accelerometer
 	for (int code = ABS_X; code < ABS_Z + 1; ++code) {
@@ -45,140 +72,538 @@ bool VirtualDevice::Connect(libevdev* device) noexcept {
 		}
 	}
 
-	// We can work without gyro, but it's a little sad that way
-	have_gyro = true;
+	bool gyro = true;
 	for (int code = ABS_RX; code < ABS_RZ + 1; ++code) {
-		have_gyro &= libevdev_has_event_code(dev, EV_ABS, code);
+		gyro &= libevdev_has_event_code(dev, EV_ABS, code);
+	}
+	// Add a profile option to enfoce this fallack?
+	const bool timestampEvent = libevdev_has_event_code(dev, EV_MSC, MSC_TIMESTAMP);
+
+	// Name alone doesn't guarantee much, so make sure that it's at least the same kind of device
+	if (sameDevice && gyro == have_gyro && timestampEvent == have_timestamp_event) {
+		// Same physical device came back, so everything we know about it still holds
+		// Clients and their packet numbers were kept intact all along
+		reconnectTime = g_get_monotonic_time();
+		if (have_timestamp_event) {
+			// Device might have restarted its clock or kept it running, so offset is decided on its first timestamp
+			reconnectTimestamp = lastTimestamp + (reconnectTime - lostTime);
+			timestampOffsetPending = true;
+			timestamp = 0;
+		}
+		std::cout << conf.name << " reconnected after " << (reconnectTime - lostTime) / 1000 << " ms\n";
+		// Samples from before dropout are no use for alignment, and clock offset has to be found anew
+		historyCount = 0;
+
+		updateInfo();
+		attachSource(!clients.empty());
+		return true;
 	}
 
+	// We can work without gyro, but it's a little sad that way
+	have_gyro = gyro;
 	if (!have_gyro) {
 		std::cout << "Gyro not found, only limited functional will be available\n";
 	}
 
+	have_timestamp_event = timestampEvent;
+	if (!have_timestamp_event) {
+		std::cout << "Accurate timestamping of motion unavailable, using fallback\n";
+	}
+
 	// Read information for each axis
+	std::array<std::int32_t, 6> center {};
+	std::array<double, 6> resolution {};
 	for (uint8_t i = ABS_X; i <= (have_gyro ? ABS_RZ : ABS_Z); ++i) {
 		auto* const info = libevdev_get_abs_info(dev, i);
 		center[i] = std::midpoint(info->minimum, info->maximum);
 		resolution[i] = info->resolution;
 	};
 
-	timestamp = 0;
+	pipeline = MakeAxisPipeline(conf.profile.mapping, conf.profile.invert, conf.profile.gyroSensitivity, center, resolution, have_gyro);
 
-	// Add a profile option to enfoce this fallack?
-	have_timestamp_event = libevdev_has_event_code(dev, EV_MSC, MSC_TIMESTAMP);
+	timestamp = 0;
+	timestamp_offset = 0;
+	lastTimestamp = 0;
+	timestampOffsetPending = false;
+	reconnectTime = 0;
+	accelFilterStates = {};
+	gyroFilterStates = {};
+	filterTimestamp = 0;
+	lastSentTime = 0;
+	suppressed.reset();
+	historyNext = 0;
+	historyCount = 0;
+	alignedTimestamp = 0;
+	if (g_alignment) {
+		// Only actually allocates on first connection
+		history.resize(g_alignment->HistorySize());
+	}
+	dropBatch();
 
-	if (!have_timestamp_event) {
-		std::cout << "Accurate timestamping of motion unavailable, using fallback\n";
+	// Main loop doesn't exist yet when devices are constructed
+	if (!batchTimerSource && batchTimer != -1) {
+		batchTimerSource = Glib::IOSource::create(batchTimer, Glib::IOCondition::IO_IN);
+		batchTimerSource->connect(sigc::mem_fun(*this, &VirtualDevice::onBatchTimer));
+		batchTimerSource->attach(g_mainloop->get_context());
 	}
 
-	source = Glib::IOSource::create(libevdev_get_fd(dev), Glib::IOCondition::IO_IN | Glib::IOCondition::IO_HUP);
-	source->connect(sigc::mem_fun(*this, &VirtualDevice::onInput));
-	source->attach(g_mainloop->get_context());
+	// Nothing of this changes until device is reconnected, so don't check it for every event
+	// Indexed by [have_gyro][have_timestamp_event][pipeline.identity]
+	static constexpr decltype(inputHandler) handlers[2][2][2] = {
+		{
+			{&VirtualDevice::onInput<false, false, false>, &VirtualDevice::onInput<false, false, true>},
+			{&VirtualDevice::onInput<false, true, false>, &VirtualDevice::onInput<false, true, true>},
+		},
+		{
+			{&VirtualDevice::onInput<true, false, false>, &VirtualDevice::onInput<true, false, true>},
+			{&VirtualDevice::onInput<true, true, false>, &VirtualDevice::onInput<true, true, true>},
+		},
+	};
+	inputHandler = handlers[have_gyro][have_timestamp_event][pipeline.identity];
+
+	updateInfo();
+
+	// Don't bother reading events until somebody is interested in them
+	attachSource(!clients.empty());
 
 	return true;
 }
 
+bool VirtualDevice::ConnectSynthetic() noexcept {
+	try {
+		auto generator = std::make_unique<SyntheticSource>(*conf.synthetic);
+		libevdev* device = generator->CreateDevice(conf.name);
+		// Connect needs to know about generator already to use its fd
+		Disconnect();
+		synthetic = std::move(generator);
+		return Connect(device);
+	} catch (std::exception& e) {
+		std::cout << "Can't create synthetic device: " << e.what() << '\n';
+		return false;
+	}
+}
+
 void VirtualDevice::Disconnect() {
+	release();
+	synthetic.reset();
+	reconnecting = false;
+	grace_timeout.disconnect();
+	dropBatch();
+	updateInfo();
+}
+
+void VirtualDevice::HandleRemoval(const char* path) {
+	if (dev && !synthetic && devnode == path) {
+		lost();
+	}
+}
+
+void VirtualDevice::release() {
 	if (dev) {
 		auto fd = libevdev_get_fd(dev);
 		libevdev_free(dev);
-		source.reset();
-		close(fd);
+		if (source) {
+			source->destroy();
+			source.reset();
+		}
+		if (fd != -1) {
+			close(fd);
+		}
 		dev = nullptr;
+		devnode.clear();
 	}
 }
 
+void VirtualDevice::lost() {
+	std::cout << conf.name << " was disconnected" << '\n';
+	release();
+
+	if (g_reconnect_grace <= 0) {
+		Disconnect();
+		return;
+	}
+
+	// Wireless devices tend to drop out for a moment, so keep pretending that it's still here for a while
+	reconnecting = true;
+	lostTime = g_get_monotonic_time();
+	grace_timeout.disconnect();
+	grace_timeout = Glib::signal_timeout().connect_once([this]() {
+		std::cout << conf.name << " didn't come back" << '\n';
+		Disconnect();
+	}, (g_reconnect_grace + 999) / 1000);
+}
+
+void VirtualDevice::attachSource(bool reading_) {
+	if (source) {
+		source->destroy();
+	}
+
+	reading = reading_;
+	// We always want to know about disconnection, even if we aren't reading
+	auto condition = Glib::IOCondition::IO_HUP;
+	if (reading) {
+		condition = condition | Glib::IOCondition::IO_IN;
+	}
+
+	if (synthetic) {
+		source = Glib::IOSource::create(synthetic->GetFd(), condition);
+		source->connect(sigc::mem_fun(*this, &VirtualDevice::onTimer));
+	} else {
+		source = Glib::IOSource::create(libevdev_get_fd(dev), condition);
+		source->connect(sigc::mem_fun(*this, inputHandler));
+	}
+	source->attach(g_mainloop->get_context());
+}
+
+void VirtualDevice::resume() {
+	if (synthetic) {
+		// Nobody needs samples we missed, but timing should go on like they happened
+		synthetic->Skip();
+		historyCount = 0;
+		attachSource(true);
+		return;
+	}
+
+	// Events that were queued while we weren't reading are stale, so skip them - but let libevdev track them anyways
+	struct input_event ev;
+	int rc;
+	do {
+		rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+		if (rc == LIBEVDEV_READ_STATUS_SUCCESS && ev.type == EV_MSC && ev.code == MSC_TIMESTAMP) {
+			updateTimestamp(ev.value);
+		}
+	} while (rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == LIBEVDEV_READ_STATUS_SYNC);
+
+	// libevdev is in sync with kernel now (it handles dropped events by itself), so take current state from it
+	for (uint8_t i = ABS_X; i <= (have_gyro ? ABS_RZ : ABS_Z); ++i) {
+		updateAxis(i, libevdev_get_event_value(dev, EV_ABS, i));
+	}
+
+	// Timestamps went on while nobody listened, so clock offset has to be found anew
+	historyCount = 0;
+	attachSource(true);
+}
+
+template<bool Gyro, bool HwTimestamp, bool Identity>
 bool VirtualDevice::onInput(Glib::IOCondition condition) {
 	if (condition & Glib::IOCondition::IO_HUP) {
 		// Device was disconnected from computer
 		// We don't actually need udev for this, hooray!
-		Disconnect();
-		std::cout << conf.name << " was disconnected" << '\n';
+		lost();
 		return false;
 	}
 
 	if (condition & Glib::IOCondition::IO_IN) {
 		struct input_event ev;
-		// FIXME: allow updating data only on accelerometer changes?
 
 		int rc;
-		do {
-			rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-
-			if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-				switch (ev.type) {
-				case EV_SYN: {
-					processSync(ev.time);
-				}
-				break;
-				case EV_MSC:
-					if (ev.code == MSC_TIMESTAMP) {
-						// Note: if device lacks this event code (check have_timestamp_event), fallback in processSync is used
-						updateTimestamp(ev.value);
+		{
+			// Reattaching source below allocates, and that is fine
+			const AllocationCheck check {conf.name, allocation_reported};
+			do {
+				rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+
+				if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+					switch (ev.type) {
+					case EV_SYN: {
+						processSync<HwTimestamp>(ev.time);
 					}
 					break;
-				case EV_ABS:
-					updateAxis(ev.code, ev.value);
-					break;
+					case EV_MSC:
+						if constexpr (HwTimestamp) {
+							if (ev.code == MSC_TIMESTAMP) {
+								updateTimestamp(ev.value);
+							}
+						}
+						break;
+					case EV_ABS:
+						ApplyAxis<Gyro, Identity>(pipeline, state, ev.code, ev.value);
+						break;
+					}
 				}
-			}
-		} while (rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == LIBEVDEV_READ_STATUS_SYNC);
+			} while (rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == LIBEVDEV_READ_STATUS_SYNC);
+		}
+
+		if (clients.empty()) {
+			// Last client is gone, so stop waking up for every event until somebody subscribes again
+			attachSource(false);
+			return false;
+		}
 	};
 
 	return true;
 }
 
+bool VirtualDevice::onTimer(Glib::IOCondition) {
+	std::array<int32_t, 6> axes;
+	int32_t eventTimestamp;
+	struct timeval time;
+
+	// Catch up on every sample we were supposed to generate, just like evdev would have queued them
+	for (uint64_t count = synthetic->Expirations(); count > 0; --count) {
+		const AllocationCheck check {conf.name, allocation_reported};
+		synthetic->NextSample(axes, eventTimestamp, time);
+		if (have_timestamp_event) {
+			updateTimestamp(eventTimestamp);
+		}
+		for (uint8_t i = ABS_X; i <= ABS_RZ; ++i) {
+			updateAxis(i, axes[i]);
+		}
+		// Synthetic devices are for testing, so it's fine to not specialize this
+		if (have_timestamp_event) {
+			processSync<true>(time);
+		} else {
+			processSync<false>(time);
+		}
+	}
+
+	if (clients.empty()) {
+		attachSource(false);
+		return false;
+	}
+
+	return true;
+}
+
+template<bool HwTimestamp>
 void VirtualDevice::processSync(struct timeval& time) {
 	if (clients.size() == 0) return; // Nobody is listening, good
 
 	// Fallback for drivers lacking fully accurate motion timing
-	if (!have_timestamp_event) {
+	if constexpr (!HwTimestamp) {
 		timestamp = uint64_t(time.tv_sec) * 1000000 + uint64_t(time.tv_usec);
 	}
 
+	if constexpr (HwTimestamp) {
+		if (timestampOffsetPending) {
+			// First sample after reconnection continues from the last one, plus time spent disconnected
+			timestamp_offset = reconnectTimestamp - timestamp;
+			timestampOffsetPending = false;
+		}
+	}
+
+	// Offset keeps time going forward across reconnections
+	const uint64_t sampleTimestamp = timestamp + timestamp_offset;
+	lastTimestamp = sampleTimestamp;
+
+	// Filter a copy, since state only gets updated for axes that have changed
+	std::array<float, 6> motion;
+	std::copy_n(state.begin(), motion.size(), motion.begin());
+	if (conf.profile.accelFilters.count || conf.profile.gyroFilters.count) {
+		// Filters ignore time for the very first sample on their own
+		const float dt = (sampleTimestamp > filterTimestamp ? (sampleTimestamp - filterTimestamp) / 1e6f : 0.0f);
+		filterTimestamp = sampleTimestamp;
+
+		std::array<float, 3> accel, gyro;
+		std::copy_n(motion.begin(), 3, accel.begin());
+		std::copy_n(motion.begin() + 3, 3, gyro.begin());
+		ApplyFilterChain(conf.profile.accelFilters, accelFilterStates, accel, dt);
+		ApplyFilterChain(conf.profile.gyroFilters, gyroFilterStates, gyro, dt);
+		std::copy(accel.begin(), accel.end(), motion.begin());
+		std::copy(gyro.begin(), gyro.end(), motion.begin() + 3);
+	}
+
+	const gint64 now = g_get_monotonic_time();
+
+	if (g_alignment) {
+		// Will be sent out on next tick, together with other devices
+		// Samples drained in one go all arrive at once, so arrival time is useless for interpolation
+		// Instead, map motion timestamps to monotonic time, letting offset creep up by 1000 ppm to follow clock drift
+		const gint64 observedOffset = now - static_cast<gint64>(sampleTimestamp);
+		if (historyCount != 0 && observedOffset > clockOffset + g_alignment->maxAge) {
+			// Samples stopped coming for a while (or clock jumped), so whatever we have is useless now
+			historyCount = 0;
+		}
+		if (historyCount == 0) {
+			clockOffset = observedOffset;
+		} else {
+			clockOffset = std::min(clockOffset + static_cast<gint64>(sampleTimestamp - clockOffsetTimestamp) / 1000, observedOffset);
+		}
+		clockOffsetTimestamp = sampleTimestamp;
+
+		history[historyNext] = {.time = static_cast<gint64>(sampleTimestamp) + clockOffset, .timestamp = sampleTimestamp, .motion = motion};
+		historyNext = (historyNext + 1) % history.size();
+		historyCount = std::min<size_t>(historyCount + 1, history.size());
+		return;
+	}
+
+	emitSample(sampleTimestamp, motion, now);
+}
+
+void VirtualDevice::EmitAligned(gint64 target) {
+	if (!dev || clients.empty() || historyCount == 0) return;
+	const AllocationCheck check {conf.name, allocation_reported};
+
+	auto sampleAt = [this](size_t age) -> const MotionSample& {
+		return history[(historyNext + history.size() - 1 - age) % history.size()];
+	};
+
+	const auto& newest = sampleAt(0);
+	if (target - newest.time > g_alignment->maxAge) {
+		// Device has gone quiet, don't keep repeating its last sample
+		return;
+	}
+
+	// Find two samples around target time, holding on to newest one if target is past it
+	uint64_t sampleTimestamp;
+	std::array<float, 6> motion;
+	if (target >= newest.time) {
+		// Assume that device clock runs at the same pace as ours
+		sampleTimestamp = newest.timestamp + (target - newest.time);
+		motion = newest.motion;
+	} else {
+		size_t age = 1;
+		while (age < historyCount && sampleAt(age).time > target) {
+			++age;
+		}
+
+		if (age == historyCount) {
+			// Nothing that old yet, which only happens right after connection
+			return;
+		} else {
+			const auto& before = sampleAt(age);
+			const auto& after = sampleAt(age - 1);
+			const float fraction = static_cast<float>(target - before.time) / (after.time - before.time);
+
+			sampleTimestamp = before.timestamp + static_cast<uint64_t>((after.timestamp - before.timestamp) * fraction);
+			for (size_t i = 0; i < motion.size(); ++i) {
+				motion[i] = before.motion[i] + (after.motion[i] - before.motion[i]) * fraction;
+			}
+		}
+	}
+
+	// Clients compute time deltas from this, so it must never go back
+	sampleTimestamp = std::max(sampleTimestamp, alignedTimestamp + 1);
+	alignedTimestamp = sampleTimestamp;
+
+	emitSample(sampleTimestamp, motion, g_get_monotonic_time());
+}
+
+void VirtualDevice::emitSample(uint64_t sampleTimestamp, const std::array<float, 6>& motion, gint64 now) {
+	if (g_suppression) {
+		const bool keepaliveDue = now - lastSentTime >= g_suppression->keepalive;
+		if (!keepaliveDue || suppressed) {
+			bool changed = false;
+			for (size_t i = 0; i < motion.size(); ++i) {
+				const float epsilon = (i < 3 ? g_suppression->accelEpsilon : g_suppression->gyroEpsilon);
+				changed |= std::abs(motion[i] - lastSent[i]) > epsilon;
+			}
+			if (!changed && !keepaliveDue) {
+				// Packet numbers only advance on sending, so clients won't consider this one lost
+				suppressed = {.time = now, .timestamp = sampleTimestamp, .motion = motion};
+				return;
+			}
+			if (changed && suppressed) {
+				// Clients integrate gyro over time since previous sample, so without this
+				// new motion would be applied over the whole suppressed span (even if keepalive is due anyways)
+				sendSample(suppressed->timestamp, suppressed->motion, now);
+			}
+		}
+		suppressed.reset();
+		lastSent = motion;
+		lastSentTime = now;
+	}
+
+	sendSample(sampleTimestamp, motion, now);
+}
+
+void VirtualDevice::sendSample(uint64_t sampleTimestamp, const std::array<float, 6>& motion, gint64 now) {
+	if (reconnectTime) {
+		std::cout << conf.name << ": first packet after reconnection sent in " << (now - reconnectTime) << " us\n";
+		reconnectTime = 0;
+	}
+
 	// Five seconds timeout
-	gint64 timeoutBefore = g_get_monotonic_time() - 5000000;
+	const gint64 timeoutBefore = now - 5000000;
 
-	// Setup common elements for array (maybe even allocate it only once per device not per call?)
-	std::array<char, 100> arr;
-	arr.fill(0);
+	// Setup common elements for array
+	packet.fill(0);
 
 	constexpr size_t headerOffset = 20;
-	FillSlotHeader(reinterpret_cast<ControllerSlotHeader*>(&arr[headerOffset]));
-	arr[headerOffset + 11] = 1; // Is connected
-	std::memset(&arr[headerOffset + 20], 127, 4); // Sticks at their centers
-	*reinterpret_cast<uint64_t*>(&arr[headerOffset + 48]) = timestamp; // Motion timestamp
-	std::memcpy(&arr[headerOffset + 56], state.data(), state.size()*sizeof(float)); // Motion data
+	FillSlotHeader(reinterpret_cast<ControllerSlotHeader*>(&packet[headerOffset]));
+	packet[headerOffset + 11] = 1; // Is connected
+	std::memset(&packet[headerOffset + 20], 127, 4); // Sticks at their centers
+	*reinterpret_cast<uint64_t*>(&packet[headerOffset + 48]) = sampleTimestamp; // Motion timestamp
+	std::memcpy(&packet[headerOffset + 56], motion.data(), motion.size()*sizeof(float)); // Motion data
 
+	bool haveBatched = false;
 	for (auto it = clients.begin(); it != clients.end();) {
 		auto clientId = it->first;
 		if (it->second.requestTime < timeoutBefore) {
 			it = clients.erase(it);
 			PacketCounter::GetInstance().RemoveRequester(clientId);
+		} else if (it->second.batched) {
+			haveBatched = true;
+			++it;
 		} else {
-			*reinterpret_cast<uint32_t*>(&arr[headerOffset + 12]) = PacketCounter::GetInstance().NewPacketNum(clientId);
-			AddHeaderAndSend({arr.data(), arr.size()}, 0x100002, it->second.addr);
+			*reinterpret_cast<uint32_t*>(&packet[headerOffset + 12]) = PacketCounter::GetInstance().NewPacketNum(clientId);
+			AddHeaderAndSend({packet.data(), packet.size()}, 0x100002, it->second.socket, it->second.addr);
 
 			++it;
 		}
 	}
-}
 
+	if (!haveBatched) {
+		// Don't hold on to samples nobody will get
+		dropBatch();
+		return;
+	}
 
-void VirtualDevice::updateAxis(uint16_t axis, int32_t value) {
-	if (axis <= ABS_RZ) {
-		auto const idx = conf.profile.mapping[axis];
-		if (idx != -1) {
-			int64_t valueCentered = static_cast<int64_t>(value) - static_cast<int64_t>(center[axis]);
+	if (batchSize == 0) {
+		batchStart = now;
+		// Device might go quiet (or have its samples suppressed) for a while, so don't rely on next sample to send this
+		itimerspec spec {};
+		spec.it_value.tv_sec = g_batching.deadline / 1000000;
+		spec.it_value.tv_nsec = (g_batching.deadline % 1000000) * 1000;
+		timerfd_settime(batchTimer, 0, &spec, nullptr);
+	}
+	auto sample = reinterpret_cast<BatchedSample*>(&batchPacket[20 + sizeof(BatchedDataHeader)]) + batchSize;
+	sample->timestamp = sampleTimestamp;
+	std::copy(motion.begin(), motion.end(), sample->motion.begin());
+	++batchSize;
 
-			if (conf.profile.invert[axis])
-				valueCentered *= -1;
+	if (batchSize >= g_batching.samples || now - batchStart >= g_batching.deadline) {
+		flushBatch();
+	}
+}
 
-			state[idx] = static_cast<double>(valueCentered) / resolution[axis];
-			if (axis >= ABS_RX)
-				state[idx] *= conf.profile.gyroSensitivity;
+void VirtualDevice::flushBatch() {
+	auto header = reinterpret_cast<BatchedDataHeader*>(&batchPacket[20]);
+	*header = {};
+	FillSlotHeader(&header->slot);
+	header->connected = 1;
+	header->sampleCount = batchSize;
+
+	const std::string_view view {batchPacket.data(), 20 + sizeof(BatchedDataHeader) + sizeof(BatchedSample) * batchSize};
+	for (auto& [clientId, client] : clients) {
+		if (client.batched) {
+			header->packetNumber = PacketCounter::GetInstance().NewPacketNum(clientId);
+			AddHeaderAndSend(view, MESSAGE_BATCHED_DATA, client.socket, client.addr);
 		}
 	}
+
+	dropBatch();
+}
+
+void VirtualDevice::dropBatch() {
+	if (batchSize) {
+		constexpr itimerspec disarm {};
+		timerfd_settime(batchTimer, 0, &disarm, nullptr);
+	}
+	batchSize = 0;
+}
+
+bool VirtualDevice::onBatchTimer(Glib::IOCondition) {
+	uint64_t expirations;
+	if (read(batchTimer, &expirations, sizeof(expirations)) == sizeof(expirations) && batchSize) {
+		const AllocationCheck check {conf.name, allocation_reported};
+		flushBatch();
+	}
+	return true;
+}
+
+void VirtualDevice::updateAxis(uint16_t axis, int32_t value) {
+	ApplyAxis<true, false>(pipeline, state, axis, value);
 }
 
 void VirtualDevice::updateTimestamp(int32_t eventTimestamp) {
@@ -202,8 +627,10 @@ void VirtualDevice::updateTimestamp(int32_t eventTimestamp) {
 
 void VirtualDevice::FillSlotHeader(ControllerSlotHeader* info) {
 	info->slotnum = number;
-	info->connectionStatus = (dev ? 2 : 0);
-	if (dev) {
+	// Temporary loss of connection is not worth bothering clients with
+	const bool connected = dev || reconnecting;
+	info->connectionStatus = (connected ? 2 : 0);
+	if (connected) {
 		info->model = (have_gyro ? 2 : 1);
 		info->connectionType = 0;
 		info->mac = name_hash; // Hash of name is the best we can get for uniqueness, I guess
@@ -211,14 +638,41 @@ void VirtualDevice::FillSlotHeader(ControllerSlotHeader* info) {
 	}
 }
 
-void VirtualDevice::ReportRequest(uint32_t id, Glib::RefPtr<Gio::SocketAddress> addr) {
+void VirtualDevice::updateInfo() {
+	std::lock_guard lock {info_mutex};
+	infoHeader = {};
+	FillSlotHeader(&infoHeader);
+	info_valid = false;
+}
+
+VirtualDevice::InfoPacket VirtualDevice::GetInfoPacket() {
+	std::lock_guard lock {info_mutex};
+	if (!info_valid) {
+		infoPacket.fill(0);
+		std::memcpy(&infoPacket[20], &infoHeader, sizeof(infoHeader));
+		AddHeader({infoPacket.data(), infoPacket.size()}, 0x100001);
+		info_valid = true;
+	}
+	return infoPacket;
+}
+
+void VirtualDevice::ReportRequest(uint32_t id, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr, bool batched) {
 	auto it = clients.find(id);
 
 	if (it == clients.end()) {
-		clients.emplace(id, ClientDescription {.addr = addr, .requestTime = g_get_monotonic_time()});
+		clients.emplace(id, ClientDescription {.socket = socket, .addr = addr, .requestTime = g_get_monotonic_time(), .batched = batched});
 		PacketCounter::GetInstance().AddRequester(id);
+		// New client shouldn't wait for motion to change
+		lastSentTime = 0;
+
+		if (dev && !reading) {
+			resume();
+		}
 	} else {
-		// Update timeout
+		// Update timeout (and address, in case client has moved)
+		it->second.socket = socket;
+		it->second.addr = addr;
 		it->second.requestTime = g_get_monotonic_time();
+		it->second.batched = batched;
 	}
 }
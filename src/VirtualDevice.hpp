@@ -26,9 +26,18 @@
 #include <cstdint>
 #include <array>
 #include <bitset>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
+#include "constants.hpp"
+#include "Filter.hpp"
 #include "packet.hpp"
+#include "pipeline.hpp"
+#include "SyntheticSource.hpp"
 
 // We generally assume this
 static_assert((ABS_X == 0) && (ABS_Z == 2) && (ABS_RX == 3) && (ABS_RZ == 5), "weird axis constants");
@@ -40,18 +49,52 @@ struct OrientationProfile {
 	std::bitset<6> invert {false}; ///< Should it be inverted
 
 	double gyroSensitivity = 1.0; ///< Multiplier for gyro values
+
+	FilterChain accelFilters; ///< Applied to virtual accelerometer axes
+	FilterChain gyroFilters; ///< Applied to virtual gyro axes
 };
 
 struct DeviceConfiguration {
 	std::string name;
 	OrientationProfile profile;
+	std::optional<SyntheticConfiguration> synthetic; ///< Generate motion instead of using real device
 
 	// std::array<std::int32_t, 6> calibration {0}; ///< TODO: Raw calibration value to apply
 };
 
 struct ClientDescription {
+	ServerSocket socket; // One that client's request came to, replies go out through it too
 	Glib::RefPtr<Gio::SocketAddress> addr;
 	gint64 requestTime; // Monotonic time from g_get_monotonic_time() for timeouts
+	bool batched; // Wants MESSAGE_BATCHED_DATA instead of regular data packets
+};
+
+/// Skip sending samples that barely differ from last sent one
+struct SuppressionConfiguration {
+	float accelEpsilon = 0.01f; ///< G
+	float gyroEpsilon = 0.5f; ///< Degrees per second
+	gint64 keepalive = 100000; ///< Send at least this often anyways, microseconds
+};
+
+/// Send all devices' samples together at fixed rate
+constexpr gint64 MAX_ALIGNMENT_DELAY = 100000; ///< Keeps history of fast devices reasonably small
+
+struct AlignmentConfiguration {
+	double rate = 250.0; ///< Ticks per second
+	gint64 delay = 5000; ///< How far behind each tick samples are taken from, microseconds
+	gint64 maxAge = 100000; ///< Stop sending device's samples if it hasn't produced any for this long, microseconds
+
+	/// Samples to keep for each device, so that even the fastest one has some from before delay
+	/// Extra 5 ms is for samples arriving late and in bursts
+	size_t HistorySize() const {
+		return static_cast<size_t>((delay + 5000) * MAX_MOTION_RATE / 1000000) + 2;
+	}
+};
+
+/// When to send out batched samples, whichever comes first
+struct BatchConfiguration {
+	uint8_t samples = 8; ///< Number of samples to collect
+	gint64 deadline = 8000; ///< Microseconds since first sample of batch
 };
 
 class VirtualDevice {
@@ -65,41 +108,133 @@ class VirtualDevice {
 		void SetConfig(DeviceConfiguration&& conf_) {
 			conf = conf_;
 			name_hash = std::hash<std::string>()(conf.name);
+			updateInfo();
 		};
 
 		// On false, call "Disconnect"
-		bool Connect(libevdev* device) noexcept;
+		// If device comes back soon after being lost, its state and timing continue where they left off
+		bool Connect(libevdev* device, const char* devnode_ = nullptr) noexcept;
+		// Same as above, but for synthetic device described by config
+		bool ConnectSynthetic() noexcept;
 		void Disconnect();
+		/// udev reported removal of device node
+		void HandleRemoval(const char* path);
 		bool IsConnected() { return dev; };
+		bool IsSynthetic() { return conf.synthetic.has_value(); };
 		size_t GetMac() { return name_hash; };
 
 		void FillSlotHeader(ControllerSlotHeader* info);
+		/// Header + ControllerSlotHeader + zero byte
+		using InfoPacket = std::array<char, 20 + sizeof(ControllerSlotHeader) + 1>;
+		/// Complete reply to controller info request for this slot
+		/// Unlike everything else here, can be called from any thread
+		InfoPacket GetInfoPacket();
+
+		/// Send sample interpolated to given monotonic time, for alignment mode
+		void EmitAligned(gint64 target);
 
-		void ReportRequest(uint32_t id, Glib::RefPtr<Gio::SocketAddress> addr);
+		void ReportRequest(uint32_t id, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr, bool batched);
 	private:
+		/// Event handler specialized for what device has, picked once on connection
+		template<bool Gyro, bool HwTimestamp, bool Identity>
 		bool onInput(Glib::IOCondition);
+		bool onTimer(Glib::IOCondition);
+		bool onBatchTimer(Glib::IOCondition);
+
+		/// Free device, but keep everything else
+		void release();
+		/// Device has gone away, maybe only for a moment
+		void lost();
+
+		/// (Re)create source for device's fd, only waiting for disconnection if not reading
+		void attachSource(bool reading_);
+		/// Start reading again after being idle
+		void resume();
 
+		template<bool HwTimestamp>
 		void processSync(struct timeval& ev);
 		void updateTimestamp(int32_t eventTimestamp);
+		/// Not specialized, for use outside of hot path
 		void updateAxis(uint16_t axis, int32_t value);
+		/// Send sample out, unless suppression says otherwise
+		void emitSample(uint64_t sampleTimestamp, const std::array<float, 6>& motion, gint64 now);
+		void sendSample(uint64_t sampleTimestamp, const std::array<float, 6>& motion, gint64 now);
+		void flushBatch();
+		/// Forget collected samples without sending them
+		void dropBatch();
+		/// Take note of changes to slot info
+		void updateInfo();
 
 		DeviceConfiguration conf;
 		size_t name_hash: 48;
 		const uint8_t number;
 		libevdev* dev = nullptr;
+		std::unique_ptr<SyntheticSource> synthetic; ///< Motion generator, if device is synthetic
+		std::string devnode;
+		std::string uniq; ///< Unique identifier of physical device (MAC address for bluetooth), might be empty
 
-		std::array<float, 6> state;
+		// Reconnection handling
+		bool reconnecting = false; ///< Device was lost recently, and we're waiting for it to come back
+		gint64 lostTime; ///< Monotonic time of loss
+		gint64 reconnectTime = 0; ///< Monotonic time of reconnection, until first packet is sent afterwards
+		sigc::connection grace_timeout;
+
+		MotionState state;
+		AxisPipeline pipeline;
+		bool (VirtualDevice::*inputHandler)(Glib::IOCondition) = nullptr;
 
 		// Kernel only reports 32-bit timestamp, so we try to compensate for this
 		uint64_t timestamp = 0;
+		uint64_t timestamp_offset = 0; ///< Added to timestamp, so that it continues across reconnections
+		uint64_t lastTimestamp = 0; ///< Of last processed sample, with offset
+		bool timestampOffsetPending = false; ///< Offset is to be set on first sample after reconnection
+		uint64_t reconnectTimestamp; ///< Timestamp that sample is to get then
+
+		FilterStates accelFilterStates;
+		FilterStates gyroFilterStates;
+		uint64_t filterTimestamp; ///< Timestamp of previous filtered sample
+
+		struct MotionSample {
+			gint64 time; ///< Motion timestamp mapped to monotonic time
+			uint64_t timestamp;
+			std::array<float, 6> motion;
+		};
 
-		std::array<std::int32_t, 6> center;
-		std::array<double, 6> resolution;
+		// Recent samples for alignment mode, ring buffer sized on connection
+		std::vector<MotionSample> history;
+		size_t historyNext = 0;
+		size_t historyCount = 0;
+		uint64_t alignedTimestamp = 0; ///< Last timestamp sent in alignment mode
+		// Difference between monotonic time and motion timestamps
+		// Lowest one observed is the one with least delivery delay, so it's the best estimate
+		gint64 clockOffset;
+		uint64_t clockOffsetTimestamp; ///< Of the sample clock offset was last updated with
+
+		std::array<float, 6> lastSent; ///< Motion in last sent sample, for suppression
+		gint64 lastSentTime = 0; ///< Monotonic time of last sent sample, zero to force sending next one
+		std::optional<MotionSample> suppressed; ///< Last sample skipped since then, if any
 
 		bool have_gyro;
 		bool have_timestamp_event;
+		bool reading = false; ///< Whether we're reading events or just waiting for disconnection
 
 		Glib::RefPtr<Glib::IOSource> source;
 
+		// Kept around (and thus pre-faulted by mlockall) instead of living on stack
+		std::array<char, 100> packet;
+		std::array<char, 20 + sizeof(BatchedDataHeader) + sizeof(BatchedSample) * MAX_BATCH_SAMPLES> batchPacket;
+
+		// Slot info as of last change and reply built from it on demand, both guarded by mutex
+		std::mutex info_mutex;
+		ControllerSlotHeader infoHeader {};
+		InfoPacket infoPacket;
+		bool info_valid = false;
+
+		uint8_t batchSize = 0; ///< Samples collected in batchPacket so far
+		gint64 batchStart; ///< Monotonic time of first sample in batch
+		int batchTimer = -1; ///< timerfd firing on batch deadline
+		Glib::RefPtr<Glib::IOSource> batchTimerSource;
+		bool allocation_reported = false; ///< Only used with allocation checking compiled in
+
 		std::unordered_map<uint32_t, ClientDescription> clients;
 };
@@ -0,0 +1,62 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "alignment.hpp"
+#include "globals.hpp"
+
+void StartAlignment(const AlignmentConfiguration& conf) {
+	// Glib timeouts only have millisecond precision, which isn't nearly enough
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		throw std::system_error(errno, std::generic_category(), "can't create alignment timer");
+	}
+
+	const auto period = static_cast<long>(1e9 / conf.rate);
+	itimerspec spec {};
+	spec.it_interval.tv_sec = period / 1000000000;
+	spec.it_interval.tv_nsec = period % 1000000000;
+	spec.it_value = spec.it_interval;
+	if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+		close(fd);
+		throw std::system_error(errno, std::generic_category(), "can't start alignment timer");
+	}
+
+	// Lives as long as main loop does
+	auto source = Glib::IOSource::create(fd, Glib::IOCondition::IO_IN);
+	source->connect([fd, delay = conf.delay](Glib::IOCondition) {
+		uint64_t expirations;
+		if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			return true;
+		}
+
+		// Missed ticks are just skipped, there's no use in sending stale samples
+		const gint64 target = g_get_monotonic_time() - delay;
+		for (auto& vdev : g_devices) {
+			vdev.EmitAligned(target);
+		}
+		return true;
+	});
+	source->attach(g_mainloop->get_context());
+}
@@ -20,3 +20,4 @@
 #include <cstdint>
 
 constexpr uint8_t SLOT_COUNT = 4; ///< Total count of slots DSU protocol supports
+constexpr uint32_t MAX_MOTION_RATE = 20000; ///< Fastest motion sample rate (per second) buffers are sized for
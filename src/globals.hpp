@@ -19,6 +19,7 @@
 #pragma once
 
 #include <array>
+#include <optional>
 #include <unordered_map>
 
 #include <glibmm/main.h>
@@ -27,7 +28,6 @@
 #include "VirtualDevice.hpp"
 #include "constants.hpp"
 
-extern Glib::RefPtr<Gio::Socket> g_socket; ///< Global socket to use
 extern Glib::RefPtr<Glib::MainLoop> g_mainloop; ///< Main loop used by application
 
 // Assign a number to each device
@@ -35,5 +35,11 @@ extern std::array<VirtualDevice, SLOT_COUNT> g_devices;
 
 extern std::unordered_map<std::string, std::uint8_t> g_name_to_devidx;
 
+extern std::optional<SuppressionConfiguration> g_suppression; ///< Suppression of unchanged samples, if enabled
+extern BatchConfiguration g_batching; ///< Batching parameters for clients supporting it
+extern std::optional<AlignmentConfiguration> g_alignment; ///< Sending all devices together, if enabled
+
+extern gint64 g_reconnect_grace; ///< How long to wait for lost device to come back, microseconds
+
 extern uint32_t g_server_id;
 extern uint8_t g_devcount;
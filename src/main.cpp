@@ -18,6 +18,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <optional>
 #include <random>
 
 #include <giomm.h>
@@ -26,28 +27,88 @@
 #include <libevdev/libevdev.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
 
 #include <glib-unix.h>
 
 #include <nlohmann/json.hpp>
 
+#include "alignment.hpp"
 #include "globals.hpp"
 #include "packet.hpp"
+#include "realtime.hpp"
+#include "server.hpp"
 
-Glib::RefPtr<Gio::Socket> g_socket; ///< Global socket to use
 Glib::RefPtr<Glib::MainLoop> g_mainloop; ///< Main loop used by application
 guint16 g_port = 26760; ///< Port to listen on
+ServerConfiguration g_server; ///< Addresses to listen on and how
+std::optional<RealtimeConfiguration> g_realtime; ///< Realtime settings, if requested
 
 // Assign a number to each device
 std::array<VirtualDevice, SLOT_COUNT> g_devices {0, 1, 2, 3};
 
 std::unordered_map<std::string, std::uint8_t> g_name_to_devidx;
 
+std::optional<SuppressionConfiguration> g_suppression;
+BatchConfiguration g_batching;
+std::optional<AlignmentConfiguration> g_alignment;
+gint64 g_reconnect_grace = 2000000;
+
 // Fits our needs just fine
 uint32_t g_server_id{std::random_device()()};
 uint8_t g_devcount {};
 
 namespace {
+	/// Create filter chain from json description
+	FilterChain ParseFilters(auto& j) {
+		FilterChain chain;
+
+		if (!j.is_array()) {
+			throw std::logic_error("filters must be an array");
+		}
+		if (j.size() > MAX_FILTER_STAGES) {
+			throw std::logic_error("too many filters (>" + std::to_string(MAX_FILTER_STAGES) + ")");
+		}
+
+		for (auto& jFilter : j) {
+			if (!(jFilter.is_object() && jFilter["type"].is_string())) {
+				throw std::logic_error("invalid filter record");
+			}
+
+			auto& stage = chain.stages[chain.count++];
+			auto parseParam = [&jFilter](const char* name, float& param, bool required) {
+				auto& jParam = jFilter[name];
+				if (jParam.is_number() && jParam >= 0) {
+					param = jParam;
+				} else if (!jParam.is_null() || required) {
+					throw std::logic_error(std::string("filter parameter `") + name + "` must be a non-negative number");
+				}
+			};
+
+			const std::string type = jFilter["type"];
+			if (type == "lowpass") {
+				stage.type = FilterStage::Type::LowPass;
+				parseParam("cutoff", stage.cutoff, true);
+				parseParam("rate", stage.rate, false);
+			} else if (type == "oneEuro") {
+				stage.type = FilterStage::Type::OneEuro;
+				parseParam("minCutoff", stage.minCutoff, false);
+				parseParam("beta", stage.beta, false);
+				parseParam("derivativeCutoff", stage.derivativeCutoff, false);
+			} else if (type == "deadzone") {
+				stage.type = FilterStage::Type::Deadzone;
+				parseParam("threshold", stage.threshold, true);
+			} else {
+				throw std::logic_error("unknown filter type `" + type + "`");
+			}
+
+			if ((stage.type == FilterStage::Type::LowPass && stage.cutoff <= 0) || (stage.type == FilterStage::Type::OneEuro && (stage.minCutoff <= 0 || stage.derivativeCutoff <= 0))) {
+				throw std::logic_error("filter cutoff frequencies must be positive");
+			}
+		}
+		return chain;
+	}
+
 	/// Create profile from json description
 	/// Input must be valid json object!
 	OrientationProfile ParseProfile(auto& j) {
@@ -120,9 +181,146 @@ namespace {
 				throw std::logic_error("gyroSensitivity must be a number (preferably float)");
 			}
 		}
+		if (auto& jAccelFilters = j["accelFilters"]; !jAccelFilters.is_null()) {
+			prof.accelFilters = ParseFilters(jAccelFilters);
+		}
+		if (auto& jGyroFilters = j["gyroFilters"]; !jGyroFilters.is_null()) {
+			prof.gyroFilters = ParseFilters(jGyroFilters);
+		}
 		return prof;
 	};
 
+	/// Create realtime configuration from json description
+	RealtimeConfiguration ParseRealtime(auto& j) {
+		RealtimeConfiguration conf;
+
+		if (j.is_boolean()) {
+			// Plain `true` means defaults for everything
+			return conf;
+		}
+
+		if (!j.is_object()) {
+			throw std::logic_error("realtime must be a boolean or an object");
+		}
+
+		{
+			auto& jPriority = j["priority"];
+			if (jPriority.is_number_integer() && jPriority >= 1 && jPriority <= 99) {
+				conf.priority = jPriority;
+			} else if (!jPriority.is_null()) {
+				throw std::logic_error("realtime priority must be an integer in range 1-99");
+			}
+		}
+		{
+			auto& jNice = j["nice"];
+			if (jNice.is_number_integer() && jNice >= -20 && jNice <= 19) {
+				conf.nice = jNice;
+			} else if (!jNice.is_null()) {
+				throw std::logic_error("realtime nice must be an integer in range -20-19");
+			}
+		}
+		{
+			auto& jCpus = j["cpus"];
+			if (jCpus.is_array()) {
+				for (auto& jCpu : jCpus) {
+					if (!(jCpu.is_number_unsigned() && jCpu < CPU_SETSIZE)) {
+						throw std::logic_error("realtime cpus must be an array of CPU numbers");
+					}
+					conf.cpus.push_back(jCpu);
+				}
+			} else if (!jCpus.is_null()) {
+				throw std::logic_error("realtime cpus must be an array of CPU numbers");
+			}
+		}
+		{
+			auto& jLockMemory = j["lockMemory"];
+			if (jLockMemory.is_boolean()) {
+				conf.lockMemory = jLockMemory;
+			} else if (!jLockMemory.is_null()) {
+				throw std::logic_error("realtime lockMemory must be a boolean");
+			}
+		}
+		return conf;
+	}
+
+	/// Create synthetic device configuration from json description
+	SyntheticConfiguration ParseSynthetic(auto& j) {
+		SyntheticConfiguration conf;
+
+		if (!j.is_object()) {
+			throw std::logic_error("synthetic device description must be an object");
+		}
+
+		{
+			auto& jWaveform = j["waveform"];
+			if (jWaveform.is_string()) {
+				const std::string waveform = jWaveform;
+				if (waveform == "sine") {
+					conf.waveform = SyntheticConfiguration::Waveform::Sine;
+				} else if (waveform == "square") {
+					conf.waveform = SyntheticConfiguration::Waveform::Square;
+				} else if (waveform == "triangle") {
+					conf.waveform = SyntheticConfiguration::Waveform::Triangle;
+				} else if (waveform == "sawtooth") {
+					conf.waveform = SyntheticConfiguration::Waveform::Sawtooth;
+				} else {
+					throw std::logic_error("unknown synthetic waveform `" + waveform + "`");
+				}
+			} else if (!jWaveform.is_null()) {
+				throw std::logic_error("synthetic waveform must be a string");
+			}
+		}
+		{
+			auto& jRate = j["rate"];
+			if (jRate.is_number() && jRate > 0 && jRate <= MAX_MOTION_RATE) {
+				conf.rate = jRate;
+			} else if (!jRate.is_null()) {
+				throw std::logic_error("synthetic rate must be a number in range (0, " + std::to_string(MAX_MOTION_RATE) + "]");
+			}
+		}
+		{
+			auto& jFrequency = j["frequency"];
+			if (jFrequency.is_number() && jFrequency >= 0) {
+				conf.frequency = jFrequency;
+			} else if (!jFrequency.is_null()) {
+				throw std::logic_error("synthetic frequency must be a non-negative number");
+			}
+		}
+		{
+			auto& jAmplitude = j["amplitude"];
+			if (jAmplitude.is_number() && jAmplitude >= 0 && jAmplitude <= 1) {
+				conf.amplitude = jAmplitude;
+			} else if (!jAmplitude.is_null()) {
+				throw std::logic_error("synthetic amplitude must be a number in range [0, 1]");
+			}
+		}
+		{
+			auto& jJitter = j["jitter"];
+			if (jJitter.is_number_unsigned() && jJitter <= 1000000) {
+				conf.jitter = jJitter;
+			} else if (!jJitter.is_null()) {
+				throw std::logic_error("synthetic jitter must be a number of microseconds, up to a second");
+			}
+		}
+		{
+			auto& jTimestampStart = j["timestampStart"];
+			if (jTimestampStart.is_number_unsigned() && jTimestampStart <= std::numeric_limits<int32_t>::max()) {
+				conf.timestampStart = jTimestampStart;
+			} else if (!jTimestampStart.is_null()) {
+				throw std::logic_error("synthetic timestampStart must be a non-negative 32-bit integer");
+			}
+		}
+		{
+			auto& jTimestamps = j["timestamps"];
+			if (jTimestamps.is_boolean()) {
+				conf.timestamps = jTimestamps;
+			} else if (!jTimestamps.is_null()) {
+				throw std::logic_error("synthetic timestamps must be a boolean");
+			}
+		}
+		return conf;
+	}
+
 	void LoadConfig(std::istream& source) {
 		using json = nlohmann::json;
 		json j;
@@ -141,6 +339,140 @@ namespace {
 			}
 		}
 
+		{
+			auto& jBind = j["bind"];
+
+			if (jBind.is_array() && !jBind.empty()) {
+				g_server.addresses.clear();
+				for (auto& jAddress : jBind) {
+					if (!jAddress.is_string()) {
+						throw std::logic_error("bind addresses must be strings");
+					}
+					g_server.addresses.push_back(jAddress);
+				}
+			} else if (!jBind.is_null()) {
+				throw std::logic_error("bind must be a non-empty array of addresses");
+			}
+		}
+
+		{
+			auto& jReceiveThreads = j["receiveThreads"];
+
+			if (jReceiveThreads.is_number_unsigned() && jReceiveThreads <= 64) {
+				g_server.threads = jReceiveThreads;
+			} else if (!jReceiveThreads.is_null()) {
+				throw std::logic_error("receiveThreads must be an integer in range 0-64");
+			}
+		}
+
+		{
+			auto& jSuppression = j["suppression"];
+
+			if (jSuppression.is_object()) {
+				SuppressionConfiguration conf;
+
+				auto parseEpsilon = [&jSuppression](const char* name, float& epsilon) {
+					auto& jEpsilon = jSuppression[name];
+					if (jEpsilon.is_number() && jEpsilon >= 0) {
+						epsilon = jEpsilon;
+					} else if (!jEpsilon.is_null()) {
+						throw std::logic_error(std::string("suppression ") + name + " must be a non-negative number");
+					}
+				};
+				parseEpsilon("accelEpsilon", conf.accelEpsilon);
+				parseEpsilon("gyroEpsilon", conf.gyroEpsilon);
+
+				auto& jKeepalive = jSuppression["keepalive"];
+				if (jKeepalive.is_number_unsigned() && jKeepalive > 0) {
+					conf.keepalive = static_cast<gint64>(jKeepalive) * 1000;
+				} else if (!jKeepalive.is_null()) {
+					throw std::logic_error("suppression keepalive must be a positive number of milliseconds");
+				}
+
+				g_suppression = conf;
+			} else if (jSuppression == true) {
+				g_suppression = SuppressionConfiguration {};
+			} else if (!jSuppression.is_null() && jSuppression != false) {
+				throw std::logic_error("suppression must be a boolean or an object");
+			}
+		}
+
+		{
+			auto& jBatching = j["batching"];
+
+			if (jBatching.is_object()) {
+				auto& jSamples = jBatching["samples"];
+				if (jSamples.is_number_unsigned() && jSamples >= 1 && jSamples <= MAX_BATCH_SAMPLES) {
+					g_batching.samples = jSamples;
+				} else if (!jSamples.is_null()) {
+					throw std::logic_error("batching samples must be an integer in range 1-" + std::to_string(MAX_BATCH_SAMPLES));
+				}
+
+				auto& jDeadline = jBatching["deadline"];
+				if (jDeadline.is_number_unsigned()) {
+					g_batching.deadline = jDeadline;
+				} else if (!jDeadline.is_null()) {
+					throw std::logic_error("batching deadline must be a number of microseconds");
+				}
+			} else if (!jBatching.is_null()) {
+				throw std::logic_error("batching must be an object");
+			}
+		}
+
+		{
+			auto& jAlignment = j["alignment"];
+
+			if (jAlignment.is_object()) {
+				AlignmentConfiguration conf;
+
+				auto& jRate = jAlignment["rate"];
+				if (jRate.is_number() && jRate > 0 && jRate <= 10000) {
+					conf.rate = jRate;
+				} else if (!jRate.is_null()) {
+					throw std::logic_error("alignment rate must be a number in range (0, 10000]");
+				}
+
+				auto parseTime = [&jAlignment](const char* name, gint64& value) {
+					auto& jValue = jAlignment[name];
+					if (jValue.is_number_unsigned()) {
+						value = jValue;
+					} else if (!jValue.is_null()) {
+						throw std::logic_error(std::string("alignment ") + name + " must be a number of microseconds");
+					}
+				};
+				parseTime("delay", conf.delay);
+				parseTime("maxAge", conf.maxAge);
+
+				if (conf.delay > MAX_ALIGNMENT_DELAY) {
+					throw std::logic_error("alignment delay must be at most " + std::to_string(MAX_ALIGNMENT_DELAY) + " microseconds");
+				}
+
+				g_alignment = conf;
+			} else if (jAlignment == true) {
+				g_alignment = AlignmentConfiguration {};
+			} else if (!jAlignment.is_null() && jAlignment != false) {
+				throw std::logic_error("alignment must be a boolean or an object");
+			}
+		}
+
+		{
+			auto& jGrace = j["reconnectGrace"];
+
+			if (jGrace.is_number_unsigned()) {
+				g_reconnect_grace = gint64(jGrace.get<uint32_t>()) * 1000;
+			} else if (!jGrace.is_null()) {
+				throw std::logic_error("reconnectGrace must be a non-negative integer");
+			}
+		}
+
+		{
+			auto& jRealtime = j["realtime"];
+
+			if (!jRealtime.is_null() && jRealtime != false) {
+				g_realtime = ParseRealtime(jRealtime);
+			}
+		}
+
 		auto& devices = j["devices"];
 		auto& profiles = j["profiles"];
 
@@ -176,6 +508,10 @@ namespace {
 			devconf.name = std::move(name);
 			devconf.profile = std::move(profile);
 
+			if (auto& jSynthetic = dev["synthetic"]; !jSynthetic.is_null()) {
+				devconf.synthetic = ParseSynthetic(jSynthetic);
+			}
+
 			g_devices[devnum].SetConfig(std::move(devconf));
 
 			++devnum;
@@ -211,15 +547,19 @@ namespace {
 		if (auto dev = MotionDeviceForPath(path)) {
 			std::cout << "Found motion device: " << libevdev_get_name(dev) << "\n";
 			auto it = g_name_to_devidx.find(libevdev_get_name(dev));
-			if (it != g_name_to_devidx.end()) {
+			if (it != g_name_to_devidx.end() && !g_devices[it->second].IsSynthetic()) {
 				std::cout << "Connecting...";
-				if (g_devices[it->second].Connect(dev)) {
+				if (g_devices[it->second].Connect(dev, path)) {
 					std::cout << " done!\n";
 				} else {
 					g_devices[it->second].Disconnect();
 					std::cout << " failed!\n";
 				}
-
+			} else {
+				// Not ours (or its slot is taken by synthetic device), so let go of it
+				const int fd = libevdev_get_fd(dev);
+				libevdev_free(dev);
+				::close(fd);
 			}
 		}
 	};
@@ -292,6 +632,19 @@ int main(int argc, char* argv[]) {
 		if (listMode)
 			exit(EXIT_SUCCESS);
 
+		for (uint8_t i = 0; i < g_devcount; ++i) {
+			auto& vdev = g_devices[i];
+			if (vdev.IsSynthetic()) {
+				std::cout << "Connecting synthetic device " << int(i) << "...";
+				if (vdev.ConnectSynthetic()) {
+					std::cout << " done!\n";
+				} else {
+					vdev.Disconnect();
+					std::cout << " failed!\n";
+				}
+			}
+		}
+
 		// Hotplug monitor
 
 		auto monitor = std::shared_ptr<udev_monitor> {udev_monitor_new_from_netlink(udev.get(), "udev"), udev_monitor_unref};
@@ -304,41 +657,36 @@ int main(int argc, char* argv[]) {
 				const char* const devnode = udev_device_get_devnode(dev.get());
 				if (!devnode)
 					continue;
-				if (std::strcmp(udev_device_get_action(dev.get()), "add") == 0) {
+				const char* const action = udev_device_get_action(dev.get());
+				if (std::strcmp(action, "add") == 0) {
 					AddDevice(devnode);
+				} else if (std::strcmp(action, "remove") == 0) {
+					// Usually noticed through hangup already, but don't count on it
+					for (auto& vdev : g_devices) {
+						vdev.HandleRemoval(devnode);
+					}
 				}
 			}
 			return true;
 		});
 		monitor_source->attach(g_mainloop->get_context());
 
-		// Setup socket
-		g_socket = Gio::Socket::create(Gio::SocketFamily::SOCKET_FAMILY_IPV4, Gio::SocketType::SOCKET_TYPE_DATAGRAM, Gio::SocketProtocol::SOCKET_PROTOCOL_UDP);
-		g_socket->set_blocking(true); // Should never block for UDP anyways
-		try {
-			g_socket->bind(Gio::InetSocketAddress::create(Gio::InetAddress::create_loopback(Gio::SocketFamily::SOCKET_FAMILY_IPV4), g_port), false);
-		} catch (Gio::Error& gerror) {
-			if (gerror.code() == Gio::Error::ADDRESS_IN_USE) {
-				std::cerr << "Can't bind socket: already used. Do you have other DSU provider running?" << '\n'
-						  << "If you need few providers running at once, try changing port." << std::endl;
-				exit(EXIT_FAILURE);
-			} else {
-				throw;
-			}
+		if (g_alignment) {
+			StartAlignment(*g_alignment);
 		}
-		auto socket_source = g_socket->create_source(Glib::IOCondition::IO_IN);
-		std::array<char, 256> buf;
-		socket_source->connect([&buf](Glib::IOCondition) {
-			Glib::RefPtr<Gio::SocketAddress> addr;
-			size_t size = g_socket->receive_from(addr, buf.data(), buf.size());
-			ProcessIncoming(addr, {buf.data(), size});
-			return true;
-		});
-		socket_source->attach(g_mainloop->get_context());
 
 		// I'd very much prefer C++ version, but there doesn't seem to be one?..
 		g_unix_signal_add(SIGINT, OnSigint, nullptr);
+
+		// Receiving threads inherit scheduling and affinity, so this must come before starting them
+		// Memory locking covers whatever is mapped later too
+		if (g_realtime) {
+			ApplyRealtime(*g_realtime);
+		}
+
+		StartServer(g_server, g_port);
 		g_mainloop->run();
+		StopServer();
 		std::cout << "Exiting" << std::endl;
 	} catch (std::exception& e) {
 		std::cerr << "Fatal error: " << e.what() << std::endl;
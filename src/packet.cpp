@@ -55,45 +55,63 @@ uint32_t PacketCounter::NewPacketNum(uint32_t id) {
 
 
 namespace {
-	struct PacketHeader {
-		std::array<char, 4> magic;
-		uint16_t version;
-		uint16_t length;
-		uint32_t CRC32;
-		uint32_t id;
-	} __attribute__((packed));
-	static_assert(sizeof(PacketHeader) == 16, "PacketHeader not packed");
-
-	struct RequestHeader {
-		uint8_t actions;
-		uint8_t slot;
-		uint64_t mac: 48;
-	} __attribute__((packed));
-	static_assert(sizeof(RequestHeader) == 8, "PacketHeader not packed");
-
 	uint32_t CalculateCrc32(std::string_view str) {
 		return crc32(0L, reinterpret_cast<const unsigned char*>(str.data()), str.size());
 	};
 
-	void FillHeaderIn(std::string_view p, uint32_t messageType) {
-		*(const_cast<uint32_t*>(reinterpret_cast<const uint32_t*>(&p[16]))) = messageType;
-		auto header = const_cast<PacketHeader*>(reinterpret_cast<const PacketHeader*>(p.data()));
-		header->magic = {'D', 'S', 'U', 'S'};
-		header->version = 1001;
-		header->length = p.size() - 16;
-		header->CRC32 = 0L;
-		header->id = g_server_id;
-		header->CRC32 = CalculateCrc32(p);
+	void HandleDataRequest(const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr, uint32_t clientId, RequestHeader req) {
+		const bool batched = req.actions & REQUEST_FLAG_BATCHED;
+		const uint8_t actions = req.actions & ~REQUEST_FLAG_BATCHED;
+
+		if (actions == 0) {
+			for (auto& vdev : g_devices) {
+				vdev.ReportRequest(clientId, socket, addr, batched);
+			}
+			return;
+		}
+
+		if ((actions & 0x1) && (req.slot < 4)) {
+			g_devices[req.slot].ReportRequest(clientId, socket, addr, batched);
+		}
+
+		if (actions & 0x2) {
+			for (auto& vdev : g_devices) {
+				if (vdev.GetMac() == req.mac) {
+					vdev.ReportRequest(clientId, socket, addr, batched);
+					break;
+				}
+			}
+		}
 	}
 }
 
-void AddHeaderAndSend(std::string_view p, uint32_t messageType, Glib::RefPtr<Gio::SocketAddress> addr) {
-	FillHeaderIn(p, messageType);
-	g_socket->send_to(addr, p.data(), p.size());
+void AddHeader(std::string_view p, uint32_t messageType) {
+	*(const_cast<uint32_t*>(reinterpret_cast<const uint32_t*>(&p[16]))) = messageType;
+	auto header = const_cast<PacketHeader*>(reinterpret_cast<const PacketHeader*>(p.data()));
+	header->magic = {'D', 'S', 'U', 'S'};
+	header->version = PROTOCOL_VERSION;
+	header->length = p.size() - 16;
+	header->CRC32 = 0L;
+	header->id = g_server_id;
+	header->CRC32 = CalculateCrc32(p);
 }
 
+void SendPacket(std::string_view p, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr) {
+	if (socket.mutex) {
+		std::lock_guard lock {*socket.mutex};
+		socket.socket->send_to(addr, p.data(), p.size());
+	} else {
+		socket.socket->send_to(addr, p.data(), p.size());
+	}
+}
+
+void AddHeaderAndSend(std::string_view p, uint32_t messageType, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr) {
+	AddHeader(p, messageType);
+	SendPacket(p, socket, addr);
+}
 
-void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p) {
+
+void ProcessIncoming(const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p) {
 	using namespace std::literals;
 	// Ensure that there's header to parse
 	if (p.length() < 16) return;
@@ -101,13 +119,13 @@ void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p)
 	if (p.substr(0, 4) != "DSUC"sv) return;
 
 	auto header = const_cast<PacketHeader*>(reinterpret_cast<const PacketHeader*>(p.data()));
-	if (header->version != 1001) return;
+	if (header->version != PROTOCOL_VERSION) return;
 	{
 		// Length handling
-		uint16_t len = header->length + 16;
+		size_t len = header->length + 16;
 		if (len < 20) return;
-		if (len < p.size()) return;
-		if (len > p.size()) p = {p.data(), len};
+		if (len > p.size()) return; // Truncated or lying
+		p = {p.data(), len};
 	}
 	{
 		// Check CRC32
@@ -129,9 +147,9 @@ void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p)
 	{
 		// Header + uint16_t
 		std::array < char, 20 + 2 > pOut;
-		*reinterpret_cast<uint16_t*>(pOut.data()) = 1001;
+		*reinterpret_cast<uint16_t*>(pOut.data()) = PROTOCOL_VERSION;
 		std::string_view outView {pOut.data(), pOut.size()};
-		AddHeaderAndSend(outView, messageType, addr);
+		AddHeaderAndSend(outView, messageType, socket, addr);
 	}
 	break;
 
@@ -140,14 +158,11 @@ void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p)
 	{
 		if (pDat.size() < (sizeof(int32_t) + 1)) return;
 		int slotCnt = std::min(*reinterpret_cast<const int32_t*>(&pDat[0]), static_cast<int32_t>(pDat.size() - sizeof(int32_t)));
-		// Header + ControllerSlotHeader + zero byte
-		std::array < char, 20 + sizeof(ControllerSlotHeader) + 1 > pOut;
-		std::string_view outView {pOut.data(), pOut.size()};
-		pOut.fill(0);
+		// Emulators poll this all the time, so replies are prepared in advance
 		for (int i = 0; i < slotCnt; ++i) {
 			if (uint8_t slot = pDat[sizeof(int32_t) + i]; slot < 4) {
-				g_devices[slot].FillSlotHeader(reinterpret_cast<ControllerSlotHeader*>(&pOut[20]));
-				AddHeaderAndSend(outView, messageType, addr);
+				const auto info = g_devices[slot].GetInfoPacket();
+				SendPacket({info.data(), info.size()}, socket, addr);
 			}
 		}
 	}
@@ -157,27 +172,23 @@ void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p)
 		// Request for controller data
 	{
 		if (pDat.size() < sizeof(RequestHeader)) return;
-		auto req = reinterpret_cast<const RequestHeader*>(pDat.data());
-
-		if (req->actions == 0) {
-			for (auto& vdev : g_devices) {
-				vdev.ReportRequest(clientId, addr);
-			}
+		const RequestHeader req = *reinterpret_cast<const RequestHeader*>(pDat.data());
+		if (!socket.mutex) {
+			// Socket isn't shared, so we're in main loop already
+			HandleDataRequest(socket, addr, clientId, req);
 			return;
 		}
 
-		if ((req->actions & 0x1) && (req->slot < 4)) {
-			g_devices[req->slot].ReportRequest(clientId, addr);
-		}
-
-		if (req->actions & 0x2) {
-			for (auto& vdev : g_devices) {
-				if (vdev.GetMac() == req->mac) {
-					vdev.ReportRequest(clientId, addr);
-					break;
-				}
-			}
-		}
+		// Devices are only ever touched from main loop
+		// Not using invoke, since it would run this right here if main loop isn't running at the moment
+		// Idle priority could starve subscriptions under load, so go with default one
+		auto source = Glib::IdleSource::create();
+		source->set_priority(Glib::PRIORITY_DEFAULT);
+		source->connect([socket, addr, clientId, req]() {
+			HandleDataRequest(socket, addr, clientId, req);
+			return false;
+		});
+		source->attach(g_mainloop->get_context());
 	}
 	break;
 	};
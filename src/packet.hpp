@@ -18,20 +18,14 @@
 
 #pragma once
 
+#include <giomm/socket.h>
 #include <giomm/socketaddress.h>
 
+#include <mutex>
 #include <string_view>
 #include <unordered_map>
 
-struct ControllerSlotHeader {
-	uint8_t slotnum;
-	uint8_t connectionStatus;
-	uint8_t model;
-	uint8_t connectionType;
-	uint64_t mac: 48;
-	uint8_t battery;
-} __attribute__((packed));
-static_assert(sizeof(ControllerSlotHeader) == 11, "ControllerSlotHeader not packed");
+#include "protocol.hpp"
 
 class PacketCounter {
 	protected:
@@ -55,5 +49,17 @@ class PacketCounter {
 		~PacketCounter() = default;
 };
 
-void ProcessIncoming(Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p);
-void AddHeaderAndSend(std::string_view p, uint32_t messageType, Glib::RefPtr<Gio::SocketAddress> addr);
+/// Socket that requests come to and replies go out through
+struct ServerSocket {
+	Glib::RefPtr<Gio::Socket> socket;
+	std::mutex* mutex = nullptr; ///< Guards socket if it's shared with receiving thread, null otherwise
+};
+
+/// Handle request that came to given socket
+/// Safe to call from any thread, requests affecting devices are handled in main loop
+void ProcessIncoming(const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr, std::string_view p);
+/// Fill in header, message type and CRC of packet whose first 20 bytes are reserved for them
+void AddHeader(std::string_view p, uint32_t messageType);
+/// Send already complete packet
+void SendPacket(std::string_view p, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr);
+void AddHeaderAndSend(std::string_view p, uint32_t messageType, const ServerSocket& socket, Glib::RefPtr<Gio::SocketAddress> addr);
@@ -0,0 +1,75 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <linux/input-event-codes.h>
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+
+// Conversion of raw axis events into motion, with everything that only depends on device and profile computed beforehand.
+// Kept free of glib and libevdev, so that it can be benchmarked on its own.
+
+/// Motion in DSU order, followed by a slot that unmapped axes are written into and nobody reads
+using MotionState = std::array<float, 7>;
+
+struct AxisPipeline {
+	static constexpr std::uint8_t SCRATCH = 6;
+
+	std::array<std::int32_t, 6> center {};
+	std::array<float, 6> scale {}; ///< Inversion, resolution and gyro sensitivity combined
+	std::array<std::uint8_t, 6> target {SCRATCH, SCRATCH, SCRATCH, SCRATCH, SCRATCH, SCRATCH};
+	bool identity = false; ///< Each present input axis goes into output axis with the same index
+};
+
+inline AxisPipeline MakeAxisPipeline(const std::array<std::int8_t, 6>& mapping, const std::bitset<6>& invert, double gyroSensitivity,
+                                     const std::array<std::int32_t, 6>& center, const std::array<double, 6>& resolution, bool haveGyro) {
+	AxisPipeline pipeline;
+	pipeline.identity = true;
+
+	for (std::uint8_t axis = ABS_X; axis <= (haveGyro ? ABS_RZ : ABS_Z); ++axis) {
+		pipeline.identity &= (mapping[axis] == axis);
+		if (mapping[axis] == -1) {
+			continue;
+		}
+
+		double scale = (invert[axis] ? -1.0 : 1.0) / resolution[axis];
+		if (axis >= ABS_RX)
+			scale *= gyroSensitivity;
+
+		pipeline.center[axis] = center[axis];
+		pipeline.scale[axis] = static_cast<float>(scale);
+		pipeline.target[axis] = mapping[axis];
+	}
+
+	return pipeline;
+}
+
+/// Axis codes beyond what device has are ignored, so it's the only check left.
+/// Permuted version is correct for any pipeline, identity one only when pipeline.identity is set.
+template<bool Gyro, bool Identity>
+inline void ApplyAxis(const AxisPipeline& pipeline, MotionState& state, std::uint16_t axis, std::int32_t value) {
+	if (axis > (Gyro ? ABS_RZ : ABS_Z))
+		return;
+
+	const std::size_t idx = (Identity ? axis : pipeline.target[axis]);
+	state[idx] = static_cast<float>(static_cast<std::int64_t>(value) - pipeline.center[axis]) * pipeline.scale[axis];
+}
@@ -0,0 +1,78 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Wire format of DSU protocol, shared by server and tools
+
+constexpr uint16_t PROTOCOL_VERSION = 1001; ///< Only version of protocol in existence
+
+struct PacketHeader {
+	std::array<char, 4> magic;
+	uint16_t version;
+	uint16_t length;
+	uint32_t CRC32;
+	uint32_t id;
+} __attribute__((packed));
+static_assert(sizeof(PacketHeader) == 16, "PacketHeader not packed");
+
+struct RequestHeader {
+	uint8_t actions;
+	uint8_t slot;
+	uint64_t mac: 48;
+} __attribute__((packed));
+static_assert(sizeof(RequestHeader) == 8, "RequestHeader not packed");
+
+struct ControllerSlotHeader {
+	uint8_t slotnum;
+	uint8_t connectionStatus;
+	uint8_t model;
+	uint8_t connectionType;
+	uint64_t mac: 48;
+	uint8_t battery;
+} __attribute__((packed));
+static_assert(sizeof(ControllerSlotHeader) == 11, "ControllerSlotHeader not packed");
+
+// evdevhook extension: batched motion data
+// Client opts in by setting REQUEST_FLAG_BATCHED in its data request. It then receives MESSAGE_BATCHED_DATA packets,
+// each carrying up to MAX_BATCH_SAMPLES motion samples, instead of regular data packets.
+// Stock clients never set this flag, so they aren't affected.
+
+constexpr uint8_t REQUEST_FLAG_BATCHED = 0x80; ///< In RequestHeader::actions, other bits keep their meaning
+constexpr uint32_t MESSAGE_BATCHED_DATA = 0x1f0002;
+constexpr uint8_t MAX_BATCH_SAMPLES = 32; ///< Keeps packet well below common MTU
+
+struct BatchedDataHeader {
+	ControllerSlotHeader slot;
+	uint8_t connected;
+	uint32_t packetNumber;
+	uint8_t sampleCount;
+	std::array<uint8_t, 3> reserved;
+} __attribute__((packed));
+static_assert(sizeof(BatchedDataHeader) == 20, "BatchedDataHeader not packed");
+
+/// Same units as in regular data packet: microseconds, G and degrees per second
+struct BatchedSample {
+	uint64_t timestamp;
+	std::array<float, 6> motion;
+} __attribute__((packed));
+static_assert(sizeof(BatchedSample) == 32, "BatchedSample not packed");
@@ -0,0 +1,160 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "realtime.hpp"
+
+#ifdef EVDEVHOOK_CHECK_ALLOCATIONS
+// Count every allocation made through libc, so that glib's and libevdev's ones are caught too
+extern "C" {
+	void* __libc_malloc(size_t size);
+	void* __libc_calloc(size_t n, size_t size);
+	void* __libc_realloc(void* ptr, size_t size);
+	void* __libc_memalign(size_t alignment, size_t size);
+	void* __libc_valloc(size_t size);
+	void* __libc_pvalloc(size_t size);
+}
+
+namespace {
+	// Per thread, so that receiving threads don't get blamed on main one
+	thread_local uint64_t allocationCount = 0;
+}
+
+extern "C" {
+	void* malloc(size_t size) {
+		++allocationCount;
+		return __libc_malloc(size);
+	}
+
+	void* calloc(size_t n, size_t size) {
+		++allocationCount;
+		return __libc_calloc(n, size);
+	}
+
+	void* realloc(void* ptr, size_t size) {
+		++allocationCount;
+		return __libc_realloc(ptr, size);
+	}
+
+	void* memalign(size_t alignment, size_t size) {
+		++allocationCount;
+		return __libc_memalign(alignment, size);
+	}
+
+	void* aligned_alloc(size_t alignment, size_t size) {
+		++allocationCount;
+		return __libc_memalign(alignment, size);
+	}
+
+	int posix_memalign(void** ptr, size_t alignment, size_t size) {
+		++allocationCount;
+		// Same requirements glibc has
+		if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+			return EINVAL;
+		}
+		void* const result = __libc_memalign(alignment, size);
+		if (!result) {
+			return ENOMEM;
+		}
+		*ptr = result;
+		return 0;
+	}
+
+	void* valloc(size_t size) {
+		++allocationCount;
+		return __libc_valloc(size);
+	}
+
+	void* pvalloc(size_t size) {
+		++allocationCount;
+		return __libc_pvalloc(size);
+	}
+}
+
+uint64_t AllocationCount() noexcept {
+	return allocationCount;
+}
+
+AllocationCheck::~AllocationCheck() {
+	if (const uint64_t allocations = AllocationCount() - before; allocations && !reported) {
+		// Reporting allocates by itself, so only do it once
+		reported = true;
+		std::cout << "Warning: " << allocations << " heap allocation(s) on input path of " << what << '\n';
+	}
+}
+#else
+uint64_t AllocationCount() noexcept {
+	return 0;
+}
+#endif
+
+namespace {
+	void PrefaultStack() {
+		// Touch a good chunk of stack so that deep calls on input path don't page fault
+		constexpr size_t prefaultSize = 256 * 1024;
+		char stack[prefaultSize];
+		std::memset(stack, 0, prefaultSize);
+		asm volatile("" : : "r"(stack) : "memory"); // Keep compiler from optimizing it away
+	}
+
+	void Report(const char* what, bool ok) {
+		std::cout << "  " << what << ": " << (ok ? "ok" : std::strerror(errno)) << '\n';
+	}
+}
+
+void ApplyRealtime(const RealtimeConfiguration& conf) {
+	std::cout << "Realtime mode:\n";
+
+	{
+		sched_param param {};
+		param.sched_priority = conf.priority;
+		const bool fifo = sched_setscheduler(0, SCHED_FIFO, &param) == 0;
+		Report("SCHED_FIFO scheduling", fifo);
+		if (!fifo) {
+			Report("nice fallback", setpriority(PRIO_PROCESS, 0, conf.nice) == 0);
+		}
+	}
+
+	if (!conf.cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : conf.cpus) {
+			CPU_SET(cpu, &set);
+		}
+		Report("CPU pinning", sched_setaffinity(0, sizeof(set), &set) == 0);
+	}
+
+	if (conf.lockMemory) {
+		// Locking current memory also faults in everything that is mapped, including device buffers
+		PrefaultStack();
+		Report("memory locking", mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+	}
+
+#ifdef EVDEVHOOK_CHECK_ALLOCATIONS
+	std::cout << "  allocation checking: enabled" << std::endl;
+#else
+	std::cout << "  allocation checking: not compiled in" << std::endl;
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+struct RealtimeConfiguration {
+	int priority = 10; ///< SCHED_FIFO priority to request
+	int nice = -10; ///< Niceness to use if SCHED_FIFO is not permitted
+	std::vector<int> cpus; ///< CPUs to pin to, empty for no pinning
+	bool lockMemory = true; ///< Lock and pre-fault all memory
+};
+
+/// Apply whatever parts of configuration we're allowed to and report results
+/// Should be called once everything long-lived is allocated, right before main loop starts
+void ApplyRealtime(const RealtimeConfiguration& conf);
+
+/// Number of heap allocations made by current thread so far (always 0 if allocation checking is not compiled in)
+uint64_t AllocationCount() noexcept;
+
+/// Warns if current thread made any heap allocations while this was alive, only once per flag
+/// Does nothing if allocation checking is not compiled in
+class AllocationCheck {
+	public:
+#ifdef EVDEVHOOK_CHECK_ALLOCATIONS
+		AllocationCheck(std::string_view what_, bool& reported_) noexcept: what(what_), reported(reported_), before(AllocationCount()) {}
+		~AllocationCheck();
+	private:
+		std::string_view what;
+		bool& reported;
+		uint64_t before;
+#else
+		AllocationCheck(std::string_view, bool&) noexcept {}
+#endif
+};
@@ -0,0 +1,198 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <giomm.h>
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "globals.hpp"
+#include "packet.hpp"
+#include "server.hpp"
+
+namespace {
+	// Main loop and receive threads barely use any stack, and with memory locking each thread's stack is locked in whole
+	constexpr size_t threadStackSize = 128 * 1024;
+
+	struct Receiver {
+		ServerSocket socket;
+		std::mutex mutex; ///< Guards socket used both by its receiving thread and main loop, if there is such thread
+		Glib::RefPtr<Glib::MainLoop> loop; ///< Only for receivers with their own thread
+		pthread_t thread;
+		bool running = false;
+		std::array<char, 256> buf;
+
+		~Receiver() {
+			// Only happens without StopServer on fatal errors, and process is about to exit anyways
+			if (running) {
+				pthread_detach(thread);
+			}
+		}
+	};
+
+	std::vector<std::unique_ptr<Receiver>> receivers;
+
+	Glib::RefPtr<Gio::Socket> CreateSocket(const Glib::RefPtr<Gio::InetAddress>& address, guint16 port, bool reusePort) {
+		auto socket = Gio::Socket::create(address->get_family(), Gio::SocketType::SOCKET_TYPE_DATAGRAM, Gio::SocketProtocol::SOCKET_PROTOCOL_UDP);
+		socket->set_blocking(true); // Should never block for UDP anyways
+
+		if (address->get_family() == Gio::SocketFamily::SOCKET_FAMILY_IPV6) {
+			// Serve IPv4 clients too when bound to "::"
+			socket->set_option(IPPROTO_IPV6, IPV6_V6ONLY, 0);
+		}
+		if (reusePort) {
+			socket->set_option(SOL_SOCKET, SO_REUSEPORT, 1);
+		}
+
+		try {
+			socket->bind(Gio::InetSocketAddress::create(address, port), false);
+		} catch (Gio::Error& gerror) {
+			if (gerror.code() == Gio::Error::ADDRESS_IN_USE) {
+				std::cerr << "Can't bind socket to " << address->to_string() << ", port " << port << ": already used. Do you have other DSU provider running?" << '\n'
+						  << "If you need few providers running at once, try changing port." << std::endl;
+				exit(EXIT_FAILURE);
+			} else {
+				throw;
+			}
+		}
+		return socket;
+	}
+
+	void Attach(Receiver& receiver, const Glib::RefPtr<Glib::MainContext>& context) {
+		auto source = receiver.socket.socket->create_source(Glib::IOCondition::IO_IN);
+		source->connect([&receiver](Glib::IOCondition) {
+			Glib::RefPtr<Gio::SocketAddress> addr;
+			size_t size;
+			if (receiver.socket.mutex) {
+				std::lock_guard lock {*receiver.socket.mutex};
+				size = receiver.socket.socket->receive_from(addr, receiver.buf.data(), receiver.buf.size());
+			} else {
+				size = receiver.socket.socket->receive_from(addr, receiver.buf.data(), receiver.buf.size());
+			}
+			ProcessIncoming(receiver.socket, addr, {receiver.buf.data(), size});
+			return true;
+		});
+		source->attach(context);
+	}
+
+	void StartThread(Receiver& receiver) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, threadStackSize);
+		// These handle whatever network throws at them, so they must never compete with input handling
+		// Affinity is still inherited, keeping them off CPUs reserved for other things
+		const sched_param param {.sched_priority = 0};
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+		pthread_attr_setschedparam(&attr, &param);
+		const int rc = pthread_create(&receiver.thread, &attr, [](void* arg) -> void* {
+			// Niceness is per thread on Linux, and lowering priority is always allowed
+			setpriority(PRIO_PROCESS, gettid(), 0);
+			static_cast<Receiver*>(arg)->loop->run();
+			return nullptr;
+		}, &receiver);
+		pthread_attr_destroy(&attr);
+
+		if (rc != 0) {
+			throw std::runtime_error(std::string("can't start receiving thread: ") + std::strerror(rc));
+		}
+		receiver.running = true;
+	}
+
+	/// Dual-stack "::" takes the port for IPv4 as well, so it can't be combined with IPv4 addresses
+	void CheckOverlap(const std::vector<Glib::RefPtr<Gio::InetAddress>>& addresses) {
+		bool anyV6 = false, haveV4 = false;
+		for (auto& address : addresses) {
+			if (address->get_family() == Gio::SocketFamily::SOCKET_FAMILY_IPV6) {
+				anyV6 |= address->get_is_any();
+			} else {
+				haveV4 = true;
+			}
+		}
+		if (anyV6 && haveV4) {
+			throw std::logic_error("bind address `::` serves IPv4 clients too, so it can't be combined with IPv4 addresses");
+		}
+	}
+}
+
+void StartServer(const ServerConfiguration& conf, guint16 port) {
+	std::vector<Glib::RefPtr<Gio::InetAddress>> addresses;
+	for (auto& addressString : conf.addresses) {
+		auto address = Gio::InetAddress::create(addressString);
+		if (!address) {
+			throw std::logic_error("invalid bind address `" + addressString + "`");
+		}
+		addresses.push_back(address);
+	}
+	CheckOverlap(addresses);
+
+	for (size_t i = 0; i < addresses.size(); ++i) {
+		if (conf.threads == 0) {
+			auto& receiver = *receivers.emplace_back(std::make_unique<Receiver>());
+			receiver.socket.socket = CreateSocket(addresses[i], port, false);
+			Attach(receiver, g_mainloop->get_context());
+		} else {
+			// Kernel spreads clients between sockets, and each client sticks to one of them
+			for (unsigned j = 0; j < conf.threads; ++j) {
+				auto& receiver = *receivers.emplace_back(std::make_unique<Receiver>());
+				receiver.socket = {.socket = CreateSocket(addresses[i], port, true), .mutex = &receiver.mutex};
+				auto context = Glib::MainContext::create();
+				receiver.loop = Glib::MainLoop::create(context);
+				Attach(receiver, context);
+			}
+		}
+
+		std::cout << "Listening on " << conf.addresses[i] << ", port " << port << '\n';
+	}
+
+	for (auto& receiver : receivers) {
+		if (receiver->loop) {
+			StartThread(*receiver);
+		}
+	}
+}
+
+void StopServer() {
+	for (auto& receiver : receivers) {
+		if (receiver->loop) {
+			// Quit from inside of loop, so that it can't be missed if loop has not started yet
+			auto loop = receiver->loop;
+			auto idle = Glib::IdleSource::create();
+			idle->connect([loop] {
+				loop->quit();
+				return false;
+			});
+			idle->attach(loop->get_context());
+			pthread_join(receiver->thread, nullptr);
+			receiver->running = false;
+		}
+	}
+	receivers.clear();
+}
@@ -0,0 +1,35 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <glibmm/main.h>
+
+#include <string>
+#include <vector>
+
+struct ServerConfiguration {
+	std::vector<std::string> addresses {"127.0.0.1"}; ///< Addresses to listen on, IPv4 or IPv6
+	unsigned threads = 0; ///< Receiving threads per address sharing it with SO_REUSEPORT, zero to receive in main loop
+};
+
+/// Bind sockets and start receiving requests
+void StartServer(const ServerConfiguration& conf, guint16 port);
+/// Stop receiving threads, if any
+void StopServer();
@@ -0,0 +1,465 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Measures end-to-end latency of evdevhook using virtual uinput motion device and loopback DSU client
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "../src/protocol.hpp"
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+	using namespace std::chrono_literals;
+
+	constexpr const char* probeName = "evdevhook latency probe";
+
+	struct Options {
+		std::optional<std::string> evdevhook; ///< Binary to spawn, use already running instance if not set
+		unsigned samples = 2000;
+		unsigned rate = 500; ///< Samples per second
+		uint16_t port = 26760;
+		uint8_t slot = 0;
+	};
+
+	[[noreturn]] void Fail(const std::string& what) {
+		throw std::system_error(errno, std::generic_category(), what);
+	}
+
+	double Microseconds(Clock::duration d) {
+		return std::chrono::duration<double, std::micro>(d).count();
+	}
+
+	/// Minimal DSU client
+	class Client {
+		public:
+			Client(uint16_t port) {
+				fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+				if (fd == -1) {
+					Fail("can't create socket");
+				}
+				server.sin_family = AF_INET;
+				server.sin_port = htons(port);
+				server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			}
+			~Client() {
+				close(fd);
+			}
+
+			void RequestVersion() {
+				std::vector<char> p(20);
+				send(p, 0x100000);
+			}
+
+			void RequestInfo(uint8_t slot) {
+				std::vector<char> p(20 + 4 + 1);
+				const int32_t slotCount = 1;
+				std::memcpy(&p[20], &slotCount, sizeof(slotCount));
+				p[24] = slot;
+				send(p, 0x100001);
+			}
+
+			void Subscribe(uint8_t slot) {
+				std::vector<char> p(20 + sizeof(RequestHeader));
+				auto req = reinterpret_cast<RequestHeader*>(&p[20]);
+				req->actions = 0x1;
+				req->slot = slot;
+				send(p, 0x100002);
+			}
+
+			/// Wait for valid packet until deadline, returning its message type
+			std::optional<uint32_t> Receive(Clock::time_point deadline) {
+				for (auto now = Clock::now(); now < deadline; now = Clock::now()) {
+					pollfd pfd {.fd = fd, .events = POLLIN, .revents = 0};
+					const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+					if (poll(&pfd, 1, timeout) <= 0) {
+						continue;
+					}
+
+					const ssize_t size = recv(fd, buf.data(), buf.size(), 0);
+					if (size < 20) {
+						continue;
+					}
+					auto header = reinterpret_cast<PacketHeader*>(buf.data());
+					const uint32_t crcExpected = header->CRC32;
+					header->CRC32 = 0;
+					if (std::string_view(header->magic.data(), 4) != "DSUS" || crc32(0L, reinterpret_cast<unsigned char*>(buf.data()), size) != crcExpected) {
+						continue;
+					}
+
+					uint32_t messageType;
+					std::memcpy(&messageType, &buf[16], sizeof(messageType));
+					return messageType;
+				}
+				return std::nullopt;
+			}
+
+			/// Slot header of last received info or data packet
+			const ControllerSlotHeader& SlotHeader() const {
+				return *reinterpret_cast<const ControllerSlotHeader*>(&buf[20]);
+			}
+
+			/// Motion timestamp of last received data packet
+			uint64_t MotionTimestamp() const {
+				uint64_t timestamp;
+				std::memcpy(&timestamp, &buf[20 + 48], sizeof(timestamp));
+				return timestamp;
+			}
+		private:
+			void send(std::vector<char>& p, uint32_t messageType) {
+				auto header = reinterpret_cast<PacketHeader*>(p.data());
+				header->magic = {'D', 'S', 'U', 'C'};
+				header->version = PROTOCOL_VERSION;
+				header->length = p.size() - 16;
+				header->CRC32 = 0;
+				header->id = id;
+				std::memcpy(&p[16], &messageType, sizeof(messageType));
+				header->CRC32 = crc32(0L, reinterpret_cast<unsigned char*>(p.data()), p.size());
+				sendto(fd, p.data(), p.size(), 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+			}
+
+			int fd;
+			uint32_t id = 0x1a7e9c1;
+			sockaddr_in server {};
+			std::array<char, 2048> buf;
+	};
+
+	/// uinput device looking just like motion part of a real controller
+	class ProbeDevice {
+		public:
+			ProbeDevice() {
+				fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+				if (fd == -1) {
+					Fail("can't open /dev/uinput");
+				}
+
+				ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_ACCELEROMETER);
+				ioctl(fd, UI_SET_EVBIT, EV_SYN);
+				ioctl(fd, UI_SET_EVBIT, EV_ABS);
+				ioctl(fd, UI_SET_EVBIT, EV_MSC);
+				ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+
+				for (uint16_t code = ABS_X; code <= ABS_RZ; ++code) {
+					ioctl(fd, UI_SET_ABSBIT, code);
+					uinput_abs_setup abs {};
+					abs.code = code;
+					abs.absinfo.minimum = -32767;
+					abs.absinfo.maximum = 32767;
+					abs.absinfo.resolution = (code < ABS_RX ? 4096 : 14);
+					if (ioctl(fd, UI_ABS_SETUP, &abs) == -1) {
+						Fail("can't setup uinput axis");
+					}
+				}
+
+				uinput_setup setup {};
+				setup.id.bustype = BUS_VIRTUAL;
+				std::strncpy(setup.name, probeName, UINPUT_MAX_NAME_SIZE - 1);
+				if (ioctl(fd, UI_DEV_SETUP, &setup) == -1 || ioctl(fd, UI_DEV_CREATE) == -1) {
+					Fail("can't create uinput device");
+				}
+			}
+			~ProbeDevice() {
+				Destroy();
+			}
+
+			void Destroy() {
+				if (fd != -1) {
+					ioctl(fd, UI_DEV_DESTROY);
+					close(fd);
+					fd = -1;
+				}
+			}
+
+			/// Emit one motion frame whose hardware timestamp identifies it
+			void Inject(uint32_t number) {
+				// Kernel drops repeated values, so keep axes moving
+				const int32_t value = (number % 2 ? 1000 : -1000);
+				std::array<input_event, 8> events {};
+				size_t count = 0;
+				for (uint16_t code = ABS_X; code <= ABS_RZ; ++code) {
+					events[count++] = {.time = {}, .type = EV_ABS, .code = code, .value = value};
+				}
+				events[count++] = {.time = {}, .type = EV_MSC, .code = MSC_TIMESTAMP, .value = static_cast<int32_t>(TimestampFor(number))};
+				events[count++] = {.time = {}, .type = EV_SYN, .code = SYN_REPORT, .value = 0};
+				if (write(fd, events.data(), sizeof(input_event) * count) == -1) {
+					Fail("can't write to uinput device");
+				}
+			}
+
+			static uint64_t TimestampFor(uint32_t number) {
+				return (uint64_t(number) + 1) * 1000;
+			}
+		private:
+			int fd = -1;
+	};
+
+	/// Poll slot info until it reports expected connection status, returning how long it took
+	std::optional<Clock::duration> WaitForSlot(Client& client, uint8_t slot, bool connected, Clock::time_point since) {
+		const auto deadline = since + 10s;
+		while (Clock::now() < deadline) {
+			client.RequestInfo(slot);
+			while (auto type = client.Receive(Clock::now() + 1ms)) {
+				if (*type == 0x100001 && client.SlotHeader().slotnum == slot && (client.SlotHeader().connectionStatus == 2) == connected) {
+					return Clock::now() - since;
+				}
+			}
+		}
+		return std::nullopt;
+	}
+
+	void PrintDistribution(std::vector<double>& values) {
+		std::sort(values.begin(), values.end());
+		auto percentile = [&values](double fraction) {
+			return values[std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()))];
+		};
+		double sum = 0;
+		for (double v : values) {
+			sum += v;
+		}
+		std::cout << "  min " << values.front() << ", p50 " << percentile(0.5) << ", p90 " << percentile(0.9)
+				  << ", p99 " << percentile(0.99) << ", max " << values.back() << ", mean " << sum / values.size() << " (us)\n";
+	}
+
+	Options ParseOptions(int argc, char* argv[]) {
+		Options opts;
+		for (int i = 1; i < argc; ++i) {
+			const std::string_view arg = argv[i];
+			auto value = [&]() -> std::string {
+				if (++i >= argc) {
+					throw std::invalid_argument("missing value for " + std::string(arg));
+				}
+				return argv[i];
+			};
+
+			if (arg == "-h") {
+				throw std::invalid_argument("evdevhook end-to-end latency harness");
+			} else if (arg == "-e") {
+				opts.evdevhook = value();
+			} else if (arg == "-n") {
+				opts.samples = std::stoul(value());
+			} else if (arg == "-r") {
+				opts.rate = std::stoul(value());
+			} else if (arg == "-p") {
+				opts.port = std::stoul(value());
+			} else if (arg == "-s") {
+				opts.slot = std::stoul(value());
+			} else {
+				throw std::invalid_argument("unknown option " + std::string(arg));
+			}
+		}
+		if (opts.samples == 0 || opts.rate == 0 || opts.slot >= 4) {
+			throw std::invalid_argument("invalid sample count, rate or slot");
+		}
+		return opts;
+	}
+
+	/// Start evdevhook with config that has our probe in slot 0
+	pid_t SpawnEvdevhook(const Options& opts, std::string& configPath) {
+		char path[] = "/tmp/evdevhook_latency_XXXXXX";
+		const int fd = mkstemp(path);
+		if (fd == -1) {
+			Fail("can't create config file");
+		}
+		close(fd);
+		configPath = path;
+
+		std::ofstream config {configPath};
+		config << "{\n"
+			   << "\t\"port\": " << opts.port << ",\n"
+			   << "\t\"reconnectGrace\": 0,\n" // Measure actual disconnection, not grace period
+			   << "\t\"profiles\": {\"probe\": {\"accel\": \"x+y+z+\", \"gyro\": \"x+y+z+\"}},\n"
+			   << "\t\"devices\": [{\"name\": \"" << probeName << "\", \"profile\": \"probe\"}]\n"
+			   << "}\n";
+		config.close();
+
+		const pid_t pid = fork();
+		if (pid == -1) {
+			Fail("can't fork");
+		} else if (pid == 0) {
+			execl(opts.evdevhook->c_str(), opts.evdevhook->c_str(), configPath.c_str(), nullptr);
+			std::perror("can't start evdevhook");
+			_exit(127);
+		}
+		return pid;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	Options opts;
+	try {
+		opts = ParseOptions(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << e.what() << '\n'
+				  << "Usage: " << argv[0] << " [-e evdevhook_binary] [-n samples] [-r rate] [-p port] [-s slot]" << '\n'
+				  << "  -e: spawn given evdevhook binary with suitable config (slot is always 0 then)" << '\n'
+				  << "  Without -e, already running evdevhook must have device \"" << probeName << "\" in given slot" << std::endl;
+		return 2;
+	}
+
+	std::string configPath;
+	pid_t evdevhook = 0;
+	int result = EXIT_SUCCESS;
+
+	try {
+		if (opts.evdevhook) {
+			opts.slot = 0;
+			evdevhook = SpawnEvdevhook(opts, configPath);
+		}
+
+		Client client {opts.port};
+
+		// Wait for server to come up
+		{
+			const auto deadline = Clock::now() + 5s;
+			bool up = false;
+			while (!up && Clock::now() < deadline) {
+				client.RequestVersion();
+				up = client.Receive(Clock::now() + 100ms) == 0x100000;
+			}
+			if (!up) {
+				throw std::runtime_error("evdevhook doesn't respond");
+			}
+		}
+
+		std::cout << std::fixed << std::setprecision(1);
+
+		// Hotplug: from device creation to slot reporting it as connected
+		const auto created = Clock::now();
+		ProbeDevice device;
+		const auto connectTime = WaitForSlot(client, opts.slot, true, created);
+		if (!connectTime) {
+			throw std::runtime_error("device was never connected, check evdevhook output");
+		}
+		std::cout << "Hotplug connect: " << Microseconds(*connectTime) << " us\n";
+
+		// Make sure data flows before measuring anything
+		client.Subscribe(opts.slot);
+		{
+			const auto deadline = Clock::now() + 5s;
+			bool flowing = false;
+			for (uint32_t i = 0; !flowing && Clock::now() < deadline; ++i) {
+				device.Inject(i);
+				while (auto type = client.Receive(Clock::now() + 10ms)) {
+					flowing |= (*type == 0x100002);
+				}
+			}
+			if (!flowing) {
+				throw std::runtime_error("no motion data received");
+			}
+		}
+
+		// Timestamps sent by warmup can't be confused with measured ones, since numbering restarts above them
+		constexpr uint32_t firstNumber = 1000000;
+		std::vector<std::optional<Clock::time_point>> sent(opts.samples);
+		std::vector<double> latencies;
+		const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / opts.rate));
+		auto lastSubscription = Clock::now();
+		auto next = Clock::now();
+
+		auto receiveUntil = [&](Clock::time_point deadline) {
+			while (auto type = client.Receive(deadline)) {
+				if (*type != 0x100002) {
+					continue;
+				}
+				const auto now = Clock::now();
+				const uint64_t timestamp = client.MotionTimestamp();
+				const uint64_t first = ProbeDevice::TimestampFor(firstNumber);
+				if (timestamp < first) {
+					continue;
+				}
+				const uint64_t idx = (timestamp - first) / 1000;
+				if (idx < sent.size() && sent[idx]) {
+					latencies.push_back(Microseconds(now - *sent[idx]));
+					sent[idx].reset();
+				}
+			}
+		};
+
+		for (uint32_t i = 0; i < opts.samples; ++i) {
+			receiveUntil(next);
+			if (Clock::now() - lastSubscription > 1s) {
+				// Keep subscription alive
+				client.Subscribe(opts.slot);
+				lastSubscription = Clock::now();
+			}
+			sent[i] = Clock::now();
+			device.Inject(firstNumber + i);
+			next += period;
+		}
+		receiveUntil(Clock::now() + 500ms);
+
+		std::cout << "Motion latency over " << latencies.size() << " of " << opts.samples << " samples:\n";
+		if (latencies.empty()) {
+			throw std::runtime_error("no samples received");
+		}
+		PrintDistribution(latencies);
+		if (latencies.size() != opts.samples) {
+			std::cout << "  lost " << opts.samples - latencies.size() << " samples\n";
+			result = EXIT_FAILURE;
+		}
+
+		// Hotplug: from device removal to slot reporting it as disconnected
+		const auto destroyed = Clock::now();
+		device.Destroy();
+		if (const auto disconnectTime = WaitForSlot(client, opts.slot, false, destroyed)) {
+			std::cout << "Hotplug disconnect: " << Microseconds(*disconnectTime) << " us" << std::endl;
+		} else {
+			std::cout << "Device was never reported as disconnected" << std::endl;
+			result = EXIT_FAILURE;
+		}
+	} catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		result = EXIT_FAILURE;
+	}
+
+	if (evdevhook) {
+		kill(evdevhook, SIGINT);
+		waitpid(evdevhook, nullptr, 0);
+		std::remove(configPath.c_str());
+	}
+
+	return result;
+}
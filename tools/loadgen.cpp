@@ -0,0 +1,367 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Simulates a bunch of DSU clients (think emulator instances) talking to evdevhook over loopback
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "../src/protocol.hpp"
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	struct Options {
+		unsigned clients = 16;
+		unsigned duration = 10; ///< Seconds
+		unsigned interval = 1000; ///< Milliseconds between periodic requests
+		uint16_t port = 26760;
+		bool perSlot = false; ///< Subscribe to each slot separately rather than to all at once
+		bool batched = false; ///< Ask for batched data extension
+	};
+
+	struct Client {
+		int fd = -1;
+		uint32_t id;
+		uint16_t port;
+		Clock::time_point nextRequest;
+
+		// Data packet accounting
+		uint64_t received = 0;
+		uint64_t samples = 0; ///< Differs from packet count for batched data
+		uint64_t lost = 0;
+		uint64_t reordered = 0;
+		uint64_t invalid = 0;
+		bool haveNumber = false;
+		uint32_t expectedNumber = 0;
+
+		// Request round trips, microseconds
+		std::optional<Clock::time_point> pendingVersion;
+		std::deque<Clock::time_point> pendingInfo; ///< Send times of unanswered info requests, oldest first
+		std::vector<double> latencies;
+	};
+
+	uint32_t CalculateCrc32(const char* data, size_t size) {
+		return crc32(0L, reinterpret_cast<const unsigned char*>(data), size);
+	}
+
+	/// Finalize and send packet built in buffer, whose first 20 bytes are reserved for header and message type
+	void Send(Client& client, const Options& opts, std::vector<char>& p, uint32_t messageType) {
+		auto header = reinterpret_cast<PacketHeader*>(p.data());
+		header->magic = {'D', 'S', 'U', 'C'};
+		header->version = PROTOCOL_VERSION;
+		header->length = p.size() - 16;
+		header->CRC32 = 0;
+		header->id = client.id;
+		std::memcpy(&p[16], &messageType, sizeof(messageType));
+		header->CRC32 = CalculateCrc32(p.data(), p.size());
+
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(opts.port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sendto(client.fd, p.data(), p.size(), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	}
+
+	/// Requests emulators commonly send every second or so: slot info and data subscription (which keeps it alive)
+	void SendRequests(Client& client, const Options& opts, bool initial) {
+		if (initial) {
+			std::vector<char> p(20);
+			Send(client, opts, p, 0x100000);
+			client.pendingVersion = Clock::now();
+		}
+
+		{
+			// Ask about every slot at once
+			std::vector<char> p(20 + 4 + 4);
+			const int32_t slotCount = 4;
+			std::memcpy(&p[20], &slotCount, sizeof(slotCount));
+			for (uint8_t i = 0; i < 4; ++i) {
+				p[24 + i] = i;
+			}
+			Send(client, opts, p, 0x100001);
+			client.pendingInfo.push_back(Clock::now());
+		}
+
+		if (opts.perSlot) {
+			for (uint8_t i = 0; i < 4; ++i) {
+				std::vector<char> p(20 + sizeof(RequestHeader));
+				auto req = reinterpret_cast<RequestHeader*>(&p[20]);
+				req->actions = 0x1 | (opts.batched ? REQUEST_FLAG_BATCHED : 0);
+				req->slot = i;
+				Send(client, opts, p, 0x100002);
+			}
+		} else {
+			std::vector<char> p(20 + sizeof(RequestHeader));
+			auto req = reinterpret_cast<RequestHeader*>(&p[20]);
+			req->actions = (opts.batched ? REQUEST_FLAG_BATCHED : 0);
+			Send(client, opts, p, 0x100002);
+		}
+	}
+
+	void Receive(Client& client) {
+		std::array<char, 2048> buf;
+		ssize_t size;
+		while ((size = recv(client.fd, buf.data(), buf.size(), MSG_DONTWAIT)) > 0) {
+			const auto now = Clock::now();
+			if (size < 20) {
+				++client.invalid;
+				continue;
+			}
+
+			auto header = reinterpret_cast<PacketHeader*>(buf.data());
+			if (std::string_view(header->magic.data(), 4) != "DSUS" || header->version != PROTOCOL_VERSION
+					|| header->length + 16u != static_cast<size_t>(size)) {
+				++client.invalid;
+				continue;
+			}
+
+			const uint32_t crcExpected = header->CRC32;
+			header->CRC32 = 0;
+			if (CalculateCrc32(buf.data(), size) != crcExpected) {
+				++client.invalid;
+				continue;
+			}
+
+			uint32_t messageType;
+			std::memcpy(&messageType, &buf[16], sizeof(messageType));
+
+			auto addLatency = [&client, now](Clock::time_point sent) {
+				client.latencies.push_back(std::chrono::duration<double, std::micro>(now - sent).count());
+			};
+
+			switch (messageType) {
+			case 0x100000:
+				if (client.pendingVersion) {
+					addLatency(*client.pendingVersion);
+					client.pendingVersion.reset();
+				}
+				break;
+			case 0x100001:
+				// Replies to info requests come one per slot, so only the first one counts
+				if (size >= 20 + 1 && buf[20] == 0 && !client.pendingInfo.empty()) {
+					addLatency(client.pendingInfo.front());
+					client.pendingInfo.pop_front();
+				}
+				break;
+			case 0x100002:
+			case MESSAGE_BATCHED_DATA: {
+				if (size < 20 + 16) {
+					++client.invalid;
+					break;
+				}
+				uint32_t number;
+				std::memcpy(&number, &buf[20 + 12], sizeof(number));
+				++client.received;
+
+				if (messageType == MESSAGE_BATCHED_DATA) {
+					const uint8_t count = reinterpret_cast<const BatchedDataHeader*>(&buf[20])->sampleCount;
+					if (count == 0 || count > MAX_BATCH_SAMPLES
+							|| static_cast<size_t>(size) != 20 + sizeof(BatchedDataHeader) + sizeof(BatchedSample) * count) {
+						++client.invalid;
+						break;
+					}
+					client.samples += count;
+				} else {
+					++client.samples;
+				}
+
+				// Packet numbers are shared by all slots client is subscribed to
+				if (!client.haveNumber) {
+					client.haveNumber = true;
+				} else if (number > client.expectedNumber) {
+					client.lost += number - client.expectedNumber;
+				} else if (number < client.expectedNumber) {
+					// We've counted this one as lost before
+					++client.reordered;
+					if (client.lost) {
+						--client.lost;
+					}
+					break;
+				}
+				client.expectedNumber = number + 1;
+			}
+			break;
+			default:
+				++client.invalid;
+				break;
+			}
+		}
+	}
+
+	double Percentile(std::vector<double>& values, double fraction) {
+		if (values.empty()) {
+			return 0;
+		}
+		const size_t idx = std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()));
+		std::nth_element(values.begin(), values.begin() + idx, values.end());
+		return values[idx];
+	}
+
+	Options ParseOptions(int argc, char* argv[]) {
+		Options opts;
+		for (int i = 1; i < argc; ++i) {
+			const std::string_view arg = argv[i];
+			auto value = [&]() -> unsigned long {
+				if (++i >= argc) {
+					throw std::invalid_argument("missing value for " + std::string(arg));
+				}
+				return std::stoul(argv[i]);
+			};
+
+			if (arg == "-h") {
+				throw std::invalid_argument("evdevhook load generator");
+			} else if (arg == "-c") {
+				opts.clients = value();
+			} else if (arg == "-d") {
+				opts.duration = value();
+			} else if (arg == "-i") {
+				opts.interval = value();
+			} else if (arg == "-p") {
+				opts.port = value();
+			} else if (arg == "-s") {
+				opts.perSlot = true;
+			} else if (arg == "-b") {
+				opts.batched = true;
+			} else {
+				throw std::invalid_argument("unknown option " + std::string(arg));
+			}
+		}
+		if (opts.clients == 0 || opts.interval == 0) {
+			throw std::invalid_argument("client count and request interval must be positive");
+		}
+		return opts;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	Options opts;
+	try {
+		opts = ParseOptions(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << e.what() << '\n'
+				  << "Usage: " << argv[0] << " [-c clients] [-d seconds] [-i request_interval_ms] [-p port] [-s] [-b]" << '\n'
+				  << "  -s: subscribe to each slot separately instead of all at once" << '\n'
+				  << "  -b: request batched data extension" << std::endl;
+		return 2;
+	}
+
+	std::random_device rd;
+	std::vector<Client> clients(opts.clients);
+	std::vector<pollfd> fds;
+	const auto start = Clock::now();
+
+	for (size_t i = 0; i < clients.size(); ++i) {
+		auto& client = clients[i];
+		client.id = rd();
+		client.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (client.fd == -1) {
+			std::perror("socket");
+			return EXIT_FAILURE;
+		}
+
+		// Let kernel pick distinct port for every client
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (bind(client.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+				|| getsockname(client.fd, reinterpret_cast<sockaddr*>(&addr), &len) == -1) {
+			std::perror("bind");
+			return EXIT_FAILURE;
+		}
+		client.port = ntohs(addr.sin_port);
+
+		// Spread requests over interval, like independently started emulators would
+		client.nextRequest = start + std::chrono::milliseconds(opts.interval) * i / clients.size();
+		SendRequests(client, opts, true);
+
+		fds.push_back({.fd = client.fd, .events = POLLIN, .revents = 0});
+	}
+
+	const auto end = start + std::chrono::seconds(opts.duration);
+	for (auto now = Clock::now(); now < end; now = Clock::now()) {
+		auto wakeup = end;
+		for (auto& client : clients) {
+			if (client.nextRequest <= now) {
+				SendRequests(client, opts, false);
+				client.nextRequest += std::chrono::milliseconds(opts.interval);
+			}
+			wakeup = std::min(wakeup, client.nextRequest);
+		}
+
+		const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wakeup - now).count();
+		if (poll(fds.data(), fds.size(), std::max<long>(timeout, 0)) > 0) {
+			for (size_t i = 0; i < fds.size(); ++i) {
+				if (fds[i].revents & POLLIN) {
+					Receive(clients[i]);
+				}
+			}
+		}
+	}
+
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	uint64_t totalReceived = 0, totalSamples = 0, totalLost = 0, totalReordered = 0, totalInvalid = 0;
+	std::vector<double> allLatencies;
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "client     id    port    pkt/s     lost  reorder  invalid   rtt p50   rtt p99   rtt max (us)\n";
+	for (size_t i = 0; i < clients.size(); ++i) {
+		auto& client = clients[i];
+		totalReceived += client.received;
+		totalSamples += client.samples;
+		totalLost += client.lost;
+		totalReordered += client.reordered;
+		totalInvalid += client.invalid;
+		allLatencies.insert(allLatencies.end(), client.latencies.begin(), client.latencies.end());
+
+		std::cout << std::setw(6) << i << ' ' << std::hex << std::setw(8) << client.id << std::dec
+				  << std::setw(8) << client.port << std::setw(9) << client.received / seconds
+				  << std::setw(9) << client.lost << std::setw(9) << client.reordered << std::setw(9) << client.invalid
+				  << std::setw(10) << Percentile(client.latencies, 0.5) << std::setw(10) << Percentile(client.latencies, 0.99)
+				  << std::setw(10) << Percentile(client.latencies, 1.0) << '\n';
+		close(client.fd);
+	}
+
+	std::cout << "\nTotal: " << totalReceived << " data packets in " << seconds << " s (" << totalReceived / seconds << " pkt/s), " << totalSamples << " motion samples\n"
+			  << "Lost: " << totalLost << ", reordered: " << totalReordered << ", invalid: " << totalInvalid << '\n'
+			  << "Request round trip p50/p90/p99/max: " << Percentile(allLatencies, 0.5) << '/' << Percentile(allLatencies, 0.9) << '/'
+			  << Percentile(allLatencies, 0.99) << '/' << Percentile(allLatencies, 1.0) << " us" << std::endl;
+
+	return (totalInvalid == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
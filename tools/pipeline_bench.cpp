@@ -0,0 +1,284 @@
+/*
+    Evdevhook - DSU server for motion from evdev compatible joysticks
+    Copyright (C) 2020  Valeri Ochinski
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Compares per-event cost of specialized axis pipelines with the generic path they replaced
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <linux/input.h>
+
+#include "../src/pipeline.hpp"
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	struct Options {
+		uint32_t samples = 1000000;
+		uint32_t rounds = 10;
+	};
+
+	struct Event {
+		uint16_t type;
+		uint16_t code;
+		int32_t value;
+	};
+
+	/// Device and profile as generic path sees them
+	struct Device {
+		std::array<std::int8_t, 6> mapping;
+		std::bitset<6> invert;
+		double gyroSensitivity;
+		std::array<std::int32_t, 6> center;
+		std::array<double, 6> resolution;
+		bool haveTimestampEvent;
+	};
+
+	/// Result of processing, so that none of it can be optimized away
+	struct Sink {
+		double sum = 0;
+		uint64_t timestamp = 0;
+
+		void Consume(const float* motion, uint64_t timestamp_) {
+			for (size_t i = 0; i < 6; ++i) {
+				sum += motion[i];
+			}
+			timestamp = timestamp_;
+		}
+	};
+
+	std::vector<Event> MakeEvents(uint32_t samples) {
+		std::vector<Event> events;
+		events.reserve(samples * 8);
+		for (uint32_t i = 0; i < samples; ++i) {
+			for (uint16_t code = ABS_X; code <= ABS_RZ; ++code) {
+				events.push_back({EV_ABS, code, static_cast<int32_t>((i * 37 + code * 1009) % 65535) - 32767});
+			}
+			events.push_back({EV_MSC, MSC_TIMESTAMP, static_cast<int32_t>(i * 1000)});
+			events.push_back({EV_SYN, SYN_REPORT, 0});
+		}
+		return events;
+	}
+
+	/// What evdevhook did before, checking the profile on each event
+	struct GenericPath {
+		const Device& dev;
+		std::array<float, 6> state {};
+		uint64_t timestamp = 0;
+
+		[[gnu::noinline]] void Run(const std::vector<Event>& events, Sink& sink) {
+			for (const Event& ev : events) {
+				switch (ev.type) {
+				case EV_SYN:
+					if (!dev.haveTimestampEvent) {
+						timestamp = ev.value;
+					}
+					sink.Consume(state.data(), timestamp);
+					break;
+				case EV_MSC:
+					if (ev.code == MSC_TIMESTAMP) {
+						timestamp = ev.value;
+					}
+					break;
+				case EV_ABS:
+					if (ev.code <= ABS_RZ) {
+						auto const idx = dev.mapping[ev.code];
+						if (idx != -1) {
+							int64_t valueCentered = static_cast<int64_t>(ev.value) - static_cast<int64_t>(dev.center[ev.code]);
+
+							if (dev.invert[ev.code])
+								valueCentered *= -1;
+
+							state[idx] = static_cast<double>(valueCentered) / dev.resolution[ev.code];
+							if (ev.code >= ABS_RX)
+								state[idx] *= dev.gyroSensitivity;
+						}
+					}
+					break;
+				}
+			}
+		}
+	};
+
+	/// Same as evdevhook does now, with handler picked once
+	template<bool Gyro, bool HwTimestamp, bool Identity>
+	struct SpecializedPath {
+		const AxisPipeline& pipeline;
+		MotionState state {};
+		uint64_t timestamp = 0;
+
+		[[gnu::noinline]] void Run(const std::vector<Event>& events, Sink& sink) {
+			for (const Event& ev : events) {
+				switch (ev.type) {
+				case EV_SYN:
+					if constexpr (!HwTimestamp) {
+						timestamp = ev.value;
+					}
+					sink.Consume(state.data(), timestamp);
+					break;
+				case EV_MSC:
+					if constexpr (HwTimestamp) {
+						if (ev.code == MSC_TIMESTAMP) {
+							timestamp = ev.value;
+						}
+					}
+					break;
+				case EV_ABS:
+					ApplyAxis<Gyro, Identity>(pipeline, state, ev.code, ev.value);
+					break;
+				}
+			}
+		}
+	};
+
+	/// Per-event time in nanoseconds for one pass over events
+	template<typename Path>
+	double Measure(Path& path, const std::vector<Event>& events, Sink& sink) {
+		const auto start = Clock::now();
+		path.Run(events, sink);
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / events.size();
+	}
+
+	/// Timings of all rounds, sorted
+	struct Timings {
+		std::vector<double> values;
+
+		double Median() const {
+			const size_t mid = values.size() / 2;
+			return (values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2);
+		}
+	};
+
+	std::ostream& operator<<(std::ostream& os, const Timings& t) {
+		return os << "median " << t.Median() << " (" << t.values.front() << "-" << t.values.back() << ")";
+	}
+
+	/// Alternate between paths each round, so that frequency scaling and other noise hits both alike
+	template<typename PathA, typename PathB>
+	std::pair<Timings, Timings> Compare(PathA& a, PathB& b, const std::vector<Event>& events, uint32_t rounds, Sink& sink) {
+		// Warm up caches and branch predictors
+		Measure(a, events, sink);
+		Measure(b, events, sink);
+
+		Timings ta, tb;
+		for (uint32_t round = 0; round < rounds; ++round) {
+			ta.values.push_back(Measure(a, events, sink));
+			tb.values.push_back(Measure(b, events, sink));
+		}
+		std::sort(ta.values.begin(), ta.values.end());
+		std::sort(tb.values.begin(), tb.values.end());
+		return {ta, tb};
+	}
+
+	Options ParseOptions(int argc, char* argv[]) {
+		Options opts;
+		for (int i = 1; i < argc; ++i) {
+			const std::string_view arg = argv[i];
+			if (arg == "-h") {
+				throw std::invalid_argument("help requested");
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + std::string(arg));
+			}
+			const unsigned long value = std::stoul(argv[++i]);
+			if (arg == "-n") {
+				opts.samples = value;
+			} else if (arg == "-r") {
+				opts.rounds = value;
+			} else {
+				throw std::invalid_argument("unknown option " + std::string(arg));
+			}
+		}
+		if (opts.samples == 0 || opts.rounds == 0) {
+			throw std::invalid_argument("samples and rounds must be positive");
+		}
+		return opts;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	Options opts;
+	try {
+		opts = ParseOptions(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << e.what() << '\n'
+				  << "Usage: " << argv[0] << " [-n samples] [-r rounds]" << std::endl;
+		return 2;
+	}
+
+	const std::vector<Event> events = MakeEvents(opts.samples);
+	Sink sink;
+
+	// Typical Switch controller (as in default config): identity and swapped axes, both with hardware timestamps
+	Device identity {
+		.mapping = {0, 1, 2, 3, 4, 5},
+		.invert = {},
+		.gyroSensitivity = 1.0,
+		.center = {},
+		.resolution = {4096, 4096, 4096, 14, 14, 14},
+		.haveTimestampEvent = true,
+	};
+	Device permuted = identity;
+	permuted.mapping = {0, 2, 1, 3, 5, 4};
+	permuted.invert = 0b100100;
+	permuted.gyroSensitivity = 1.5;
+
+	struct Case {
+		const char* name;
+		const Device& dev;
+	};
+	std::cout << std::fixed << std::setprecision(2)
+			  << opts.rounds << " rounds over " << opts.samples << " samples (" << events.size() << " events), ns per event, median (min-max):\n";
+	for (const Case& c : {Case {"identity mapping", identity}, Case {"permuted mapping", permuted}}) {
+		const AxisPipeline pipeline = MakeAxisPipeline(c.dev.mapping, c.dev.invert, c.dev.gyroSensitivity, c.dev.center, c.dev.resolution, true);
+
+		GenericPath generic {c.dev};
+		std::pair<Timings, Timings> result;
+		if (pipeline.identity) {
+			SpecializedPath<true, true, true> specialized {pipeline};
+			result = Compare(generic, specialized, events, opts.rounds, sink);
+		} else {
+			SpecializedPath<true, true, false> specialized {pipeline};
+			result = Compare(generic, specialized, events, opts.rounds, sink);
+		}
+
+		const auto& [genericTime, specializedTime] = result;
+		std::cout << "  " << c.name << ":\n"
+				  << "    generic     " << genericTime << '\n'
+				  << "    specialized " << specializedTime << '\n'
+				  << "    speedup of medians " << genericTime.Median() / specializedTime.Median() << "x\n";
+	}
+
+	// Keep results observable
+	if (sink.timestamp == 1) {
+		std::cout << sink.sum << '\n';
+	}
+
+	return EXIT_SUCCESS;
+}